@@ -3,10 +3,315 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include <stdarg.h>
 #include "MallocTracer.h"
 #include "MallocTracer_conf.h"
 
+/* ===================== default config ============================*/
+/* every option could be override in MallocTracer_conf.h */
+
+#ifndef MALLOC_TRANCER_LOG
+#define MALLOC_TRANCER_LOG(...) printf(__VA_ARGS__)
+#endif
+
+/* debug profile: put guard bytes before and after each block */
+#ifndef MALLOC_TRANCER_ENABLE_REDZONE
+#define MALLOC_TRANCER_ENABLE_REDZONE 0
+#endif
+
+/* guard bytes on each side, must be a multiple of 8 */
+#ifndef MALLOC_TRANCER_REDZONE_SIZE
+#define MALLOC_TRANCER_REDZONE_SIZE 16
+#endif
+
+#ifndef MALLOC_TRANCER_REDZONE_PATTERN
+#define MALLOC_TRANCER_REDZONE_PATTERN 0xA5
+#endif
+
+/* do not pass a unknown or already freed address to the real free */
+#ifndef MALLOC_TRANCER_BLOCK_INVALID_FREE
+#define MALLOC_TRANCER_BLOCK_INVALID_FREE 0
+#endif
+
+/* keep live blocks in a address ordered AVL tree too, for fragmentation and owner lookup */
+#ifndef MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+#define MALLOC_TRANCER_ENABLE_ADDRESS_INDEX 1
+#endif
+
+/* the heap range for getFragmentation(), 0/0 means from the first to the last live block */
+#ifndef MALLOC_TRANCER_HEAP_START
+#define MALLOC_TRANCER_HEAP_START 0
+#endif
+
+#ifndef MALLOC_TRANCER_HEAP_END
+#define MALLOC_TRANCER_HEAP_END 0
+#endif
+
+/* how many owners (tasks/threads) are counted, the last one is shared by all the others */
+#ifndef MALLOC_TRANCER_MAX_OWNERS
+#define MALLOC_TRANCER_MAX_OWNERS 16
+#endif
+
+/* how many fixed block pools addPool() can register per instance */
+#ifndef MALLOC_TRANCER_MAX_POOLS
+#define MALLOC_TRANCER_MAX_POOLS 8
+#endif
+
+/* ISR safe mode: trace_malloc/trace_free only push a event to a ring,
+ * drain() (a low priority task, or startAggregator() on linux) updates the tables */
+#ifndef MALLOC_TRANCER_ENABLE_DEFERRED
+#define MALLOC_TRANCER_ENABLE_DEFERRED 0
+#endif
+
+/* one ring per core or per interrupt level, each ring must have only one producer */
+#ifndef MALLOC_TRANCER_RING_COUNT
+#define MALLOC_TRANCER_RING_COUNT 1
+#endif
+
+/* events per ring, must be a power of 2 */
+#ifndef MALLOC_TRANCER_RING_LENGTH
+#define MALLOC_TRANCER_RING_LENGTH 64
+#endif
+
+/* which ring the caller pushes to, e.g. (__get_IPSR() ? 1 : 0) */
+#ifndef MALLOC_TRANCER_CURRENT_RING
+#define MALLOC_TRANCER_CURRENT_RING() 0
+#endif
+
+/* ring head/tail access, acquire/release is all the SPSC ring needs */
+#ifndef MALLOC_TRANCER_LOAD_ACQUIRE
+#define MALLOC_TRANCER_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#endif
+
+#ifndef MALLOC_TRANCER_STORE_RELEASE
+#define MALLOC_TRANCER_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/* protect the tables of one instance when tracing from several threads, e.g. a mutex.
+ * every instance has its own MALLOC_TRANCER_LOCK_TYPE, so the heaps do not wait for each other,
+ * override the four together */
+#ifndef MALLOC_TRANCER_LOCK
+#if MALLOC_TRANCER_ENABLE_DEFERRED && defined(__linux__)
+#include <pthread.h>
+#define MALLOC_TRANCER_LOCK_TYPE pthread_mutex_t
+#define MALLOC_TRANCER_LOCK_INIT(lock) pthread_mutex_init(lock, NULL)
+#define MALLOC_TRANCER_LOCK(lock) pthread_mutex_lock(lock)
+#define MALLOC_TRANCER_UNLOCK(lock) pthread_mutex_unlock(lock)
+#else
+#define MALLOC_TRANCER_LOCK_TYPE uint8_t
+#define MALLOC_TRANCER_LOCK_INIT(lock) ((void)(lock))
+#define MALLOC_TRANCER_LOCK(lock) ((void)(lock))
+#define MALLOC_TRANCER_UNLOCK(lock) ((void)(lock))
+#endif
+#endif
+
+/* bytes writeReport() collects on the stack before each sink call */
+#ifndef MALLOC_TRANCER_WRITER_BUFFER_SIZE
+#define MALLOC_TRANCER_WRITER_BUFFER_SIZE 128
+#endif
+
+/* stage the output for a transport (UART, RTT, file...), see setTransport() */
+#ifndef MALLOC_TRANCER_ENABLE_TRANSPORT
+#define MALLOC_TRANCER_ENABLE_TRANSPORT 0
+#endif
+
+#ifndef MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE
+#define MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE 512
+#endif
+
+/* protect the staging buffer, it is written inside and outside MALLOC_TRANCER_LOCK */
+#ifndef MALLOC_TRANCER_TRANSPORT_LOCK
+#if MALLOC_TRANCER_ENABLE_TRANSPORT && MALLOC_TRANCER_ENABLE_DEFERRED && defined(__linux__)
+#include <pthread.h>
+static pthread_mutex_t mallocTrancerTransportMutex = PTHREAD_MUTEX_INITIALIZER;
+#define MALLOC_TRANCER_TRANSPORT_LOCK() pthread_mutex_lock(&mallocTrancerTransportMutex)
+#define MALLOC_TRANCER_TRANSPORT_UNLOCK() pthread_mutex_unlock(&mallocTrancerTransportMutex)
+#else
+#define MALLOC_TRANCER_TRANSPORT_LOCK()
+#define MALLOC_TRANCER_TRANSPORT_UNLOCK()
+#endif
+#endif
+
+/* max bytes the tracer itself may malloc for its tables, 0 means no limit.
+ * over 3/4 of it, blocks of the positions that never leaked are not stored,
+ * over all of it, no block is stored and new positions go to "(other)" */
+#ifndef MALLOC_TRANCER_MEMORY_BUDGET
+#define MALLOC_TRANCER_MEMORY_BUDGET 0
+#endif
+
+/* the addresses of the blocks the budget does not store, a fixed set so their free is
+ * told from a invalid one, must be a power of 2. over 3/4 of it the blocks are stored again */
+#ifndef MALLOC_TRANCER_UNTRACKED_LENGTH
+#define MALLOC_TRANCER_UNTRACKED_LENGTH 128
+#endif
+
+/* the backend's own count of the bytes in use for the heapUsed hook of the default heap:
+ * 0 none, MALLOC_TRANCER_HEAP_STATS_MALLINFO glibc mallinfo2(),
+ * MALLOC_TRANCER_HEAP_STATS_SBRK newlib, the sbrk(0) break above MALLOC_TRANCER_SBRK_BASE,
+ * MALLOC_TRANCER_HEAP_STATS_FREERTOS configTOTAL_HEAP_SIZE - xPortGetFreeHeapSize() */
+#define MALLOC_TRANCER_HEAP_STATS_MALLINFO 1
+#define MALLOC_TRANCER_HEAP_STATS_SBRK     2
+#define MALLOC_TRANCER_HEAP_STATS_FREERTOS 3
+#ifndef MALLOC_TRANCER_HEAP_STATS
+#define MALLOC_TRANCER_HEAP_STATS 0
+#endif
+
+/* the allocator's block layout, for the overhead estimate, glibc/newlib (dlmalloc) by default */
+#ifndef MALLOC_TRANCER_HEAP_BLOCK_HEADER
+#define MALLOC_TRANCER_HEAP_BLOCK_HEADER sizeof(size_t)
+#endif
+
+#ifndef MALLOC_TRANCER_HEAP_BLOCK_ALIGN
+#define MALLOC_TRANCER_HEAP_BLOCK_ALIGN (2 * sizeof(size_t))
+#endif
+
+#ifndef MALLOC_TRANCER_HEAP_BLOCK_MIN
+#define MALLOC_TRANCER_HEAP_BLOCK_MIN (4 * sizeof(size_t))
+#endif
+
+/* positions listed under PEAK in the report */
+#ifndef MALLOC_TRANCER_PEAK_REPORT_LENGTH
+#define MALLOC_TRANCER_PEAK_REPORT_LENGTH 5
+#endif
+
+/* sampleHeap() periods the untraced bytes are followed over */
+#ifndef MALLOC_TRANCER_HEAP_HISTORY
+#define MALLOC_TRANCER_HEAP_HISTORY 16
+#endif
+
+/* linux host: publish the POSITION counters in a shm_open region for MallocTracerView */
+#ifndef MALLOC_TRANCER_ENABLE_SHM
+#define MALLOC_TRANCER_ENABLE_SHM 0
+#endif
+
+#ifndef MALLOC_TRANCER_SHM_NAME
+#define MALLOC_TRANCER_SHM_NAME "/MallocTracer"
+#endif
+
+#ifndef MALLOC_TRANCER_SHM_MAX_SITES
+#define MALLOC_TRANCER_SHM_MAX_SITES 1024
+#endif
+
+/* keep a ring of the live bytes of each position per sampleTrend() period,
+ * with a running linear regression, for suspectedLeaks() */
+#ifndef MALLOC_TRANCER_ENABLE_TREND
+#define MALLOC_TRANCER_ENABLE_TREND 0
+#endif
+
+/* periods in the window */
+#ifndef MALLOC_TRANCER_TREND_LENGTH
+#define MALLOC_TRANCER_TREND_LENGTH 16
+#endif
+
+/* min fitted growth in bytes over a full window to be a suspected leak */
+#ifndef MALLOC_TRANCER_TREND_MIN_GROWTH
+#define MALLOC_TRANCER_TREND_MIN_GROWTH 1
+#endif
+
+/* send each malloc/free to a sink as a delta + varint record, see setEventStream() */
+#ifndef MALLOC_TRANCER_ENABLE_STREAM
+#define MALLOC_TRANCER_ENABLE_STREAM 0
+#endif
+
+/* time of the stream records, any unit, e.g. xTaskGetTickCount() or DWT->CYCCNT */
+#ifndef MALLOC_TRANCER_TIMESTAMP
+#define MALLOC_TRANCER_TIMESTAMP() 0
+#define MALLOC_TRANCER_TIMESTAMP_UNSET
+#endif
+
+/* per position histogram of how long the blocks live, malloc to free */
+#ifndef MALLOC_TRANCER_ENABLE_LIFETIME
+#define MALLOC_TRANCER_ENABLE_LIFETIME 0
+#endif
+
+/* the clock of the lifetimes, e.g. xTaskGetTickCount() or HAL_GetTick(), may wrap at 32 bits.
+ * MALLOC_TRANCER_TIMESTAMP() if it is set, else milliseconds of CLOCK_MONOTONIC on linux */
+#ifndef MALLOC_TRANCER_LIFETIME_CLOCK
+#if !defined(MALLOC_TRANCER_TIMESTAMP_UNSET)
+#define MALLOC_TRANCER_LIFETIME_CLOCK() MALLOC_TRANCER_TIMESTAMP()
+#elif defined(__linux__)
+#include <time.h>
+#define MALLOC_TRANCER_LIFETIME_CLOCK() utils_monotonic_ms()
+#define LIFETIME_CLOCK_MONOTONIC
+#elif MALLOC_TRANCER_ENABLE_LIFETIME
+#error "MALLOC_TRANCER_ENABLE_LIFETIME needs a clock, set MALLOC_TRANCER_LIFETIME_CLOCK() or MALLOC_TRANCER_TIMESTAMP()"
+#endif
+#endif
+
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+#define LIFETIME_NOW() ((uint32_t)MALLOC_TRANCER_LIFETIME_CLOCK())
+#else
+#define LIFETIME_NOW() 0
+#endif
+
+/* serve the hot fixed size positions from a slab of their own, see getSlabs() */
+#ifndef MALLOC_TRANCER_ENABLE_SLAB
+#define MALLOC_TRANCER_ENABLE_SLAB 0
+#endif
+
+/* how many positions may get a slab, each slab is checked at every free */
+#ifndef MALLOC_TRANCER_SLAB_MAX_SITES
+#define MALLOC_TRANCER_SLAB_MAX_SITES 4
+#endif
+
+/* blocks of a slab, malloc at once from the backend and never given back */
+#ifndef MALLOC_TRANCER_SLAB_BLOCKS
+#define MALLOC_TRANCER_SLAB_BLOCKS 32
+#endif
+
+/* the biggest block a slab is made for */
+#ifndef MALLOC_TRANCER_SLAB_MAX_BLOCK_SIZE
+#define MALLOC_TRANCER_SLAB_MAX_BLOCK_SIZE 256
+#endif
+
+/* a position gets a slab once it does MIN_RATE of the last WINDOW mallocs of its instance,
+ * and one size (rounded up to SLAB_ALIGN) wins the majority vote of its mallocs by MIN_RATE / 2 */
+#ifndef MALLOC_TRANCER_SLAB_WINDOW
+#define MALLOC_TRANCER_SLAB_WINDOW 1024
+#endif
+
+#ifndef MALLOC_TRANCER_SLAB_MIN_RATE
+#define MALLOC_TRANCER_SLAB_MIN_RATE 64
+#endif
+
+/* alignment of the slab blocks, the one of malloc */
+#ifndef MALLOC_TRANCER_SLAB_ALIGN
+#define MALLOC_TRANCER_SLAB_ALIGN (2 * sizeof(void*))
+#endif
+
+/* time the tracer's own work in trace_malloc/trace_free, see getProfile() */
+#ifndef MALLOC_TRANCER_ENABLE_PROFILE
+#define MALLOC_TRANCER_ENABLE_PROFILE 0
+#endif
+
+/* a free running counter for the profile, only differences are used, so it may wrap at 32 bits */
+#ifndef MALLOC_TRANCER_CYCLES
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+#define MALLOC_TRANCER_CYCLES() (*(volatile uint32_t*)0xE0001004)   /* DWT->CYCCNT */
+/* DEMCR.TRCENA, then DWT->CTRL.CYCCNTENA */
+#define MALLOC_TRANCER_CYCLES_INIT() do { \
+    *(volatile uint32_t*)0xE000EDFC |= 1u << 24; \
+    *(volatile uint32_t*)0xE0001000 |= 1u; \
+} while(0)
+#elif defined(__x86_64__) || defined(__i386__)
+#define MALLOC_TRANCER_CYCLES() __builtin_ia32_rdtsc()
+#elif defined(__linux__)
+#include <time.h>
+#define MALLOC_TRANCER_CYCLES() utils_monotonic_ns()
+#else
+#define MALLOC_TRANCER_CYCLES() 0
+#endif
+#endif
+
+#ifndef MALLOC_TRANCER_CYCLES_INIT
+#define MALLOC_TRANCER_CYCLES_INIT()
+#endif
+
+/* how many recent frees are kept to recognize a double free */
+#ifndef MALLOC_TRANCER_RECENT_FREE_LENGTH
+#define MALLOC_TRANCER_RECENT_FREE_LENGTH 16
+#endif
+
 
 /* ===================== hashmap.c ===============================*/
 struct HashMap * New_HashMap();
@@ -19,14 +324,19 @@ struct Tree_Node {
     struct Tree_Node * right;
     struct Tree_Node * root;
     struct Tree_Node * next;
+    struct Tree_Node * prev;
 };
 
 struct HashMap {
     struct Tree * tab;
+    size_t count;        /* nodes in the map */
+    size_t keyBytes;     /* bytes of the key copies */
     void * (*get)(struct HashMap * hashmap, char * key);
     bool (*put)(struct HashMap * hashmap, char * key, void * value);
     bool (*delete)(struct HashMap * hashmap, char * key);
+    void * (*remove)(struct HashMap * hashmap, char * key);
     struct HashMap_Iterator * (*createIterator)(struct HashMap * hashmap);
+    void (*initIterator)(struct HashMap * hashmap, struct HashMap_Iterator * iterator);
 };
 
 struct HashMap_Iterator {
@@ -44,7 +354,7 @@ struct HashMap_Iterator {
  * date: 2020/8/11
  * note: 
  * a. 由于C语言没有垃圾回收机制，故hashmap的每个value需要用户手动malloc。
- * b. 暂时只支持查找、添加、更改，不支持删除。
+ * b. 支持查找、添加、更改、删除。
  * b. 使用方法：
  *    见test case.
  */
@@ -57,10 +367,11 @@ struct HashMap_Iterator {
 #include <stdio.h>
 
 /* base struct ---------------------------------------------------------------*/
-/* BST二叉搜索树 */
+/* BST二叉搜索树, every node of the tab is also linked in a list for the iterator */
 
 struct Tree {
     struct Tree_Node * root;
+    struct Tree_Node * head;
     struct Tree_Node * (*search)(struct Tree * tree, char * key);
     bool (*insert)(struct Tree * tree, char * key, void * value);
 };
@@ -72,7 +383,7 @@ struct Tree {
 static bool tree_insert(struct Tree * tree, char * key, void * value);
 static struct Tree_Node * tree_search(struct Tree * tree, char * key);
 static struct HashMap_Iterator * hashmap_create_iterator(struct HashMap * hashmap);
-static struct Tree_Node * tree_dfs(struct Tree_Node * node);
+static void hashmap_init_iterator(struct HashMap * hashmap, struct HashMap_Iterator * iterator);
 
 /* main code  -----------------------------------------------------------------*/
 
@@ -85,12 +396,31 @@ _hash(char *str)
     unsigned long hash = 5381;
     int c;
 
-    while (c = *str++)
+    while ((c = *str++))
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
 
     return hash;
 }
 
+/**
+ * @brief malloc a node, copy the key, and link it at the head of the tab list
+ */
+static struct Tree_Node * tree_new_node(struct Tree * tree, unsigned long hash, char * key, void * value) {
+    struct Tree_Node * node = (struct Tree_Node*)malloc(sizeof(struct Tree_Node));
+    node->hash = hash;
+    node->key = (char*)malloc(strlen(key) + 1);
+    strcpy(node->key, key);
+    node->value = value;
+    node->left = NULL;
+    node->right = NULL;
+    node->root = NULL;
+    node->prev = NULL;
+    node->next = tree->head;
+    if(tree->head) tree->head->prev = node;
+    tree->head = node;
+    return node;
+}
+
 /**
  * @brief put a key_value to a hash map
  * @param hashmap which hash map to opreate
@@ -108,17 +438,11 @@ static bool hashmap_put(struct HashMap * hashmap, char * key, void * value) {
     
     /* new tab */
     if(!targetTab->root) {
-        targetTab->root = (struct Tree_Node*)malloc(sizeof(struct Tree_Node));
-        targetTab->root->hash = hash;
-        targetTab->root->key = (char*)malloc(strlen(key));
-        strcpy(targetTab->root->key, key);
-        targetTab->root->value = value;
-        targetTab->root->left = NULL;
-        targetTab->root->right = NULL;
-        targetTab->root->root = NULL;
-        targetTab->root->next = NULL;
         targetTab->search = tree_search;
         targetTab->insert = tree_insert;
+        targetTab->root = tree_new_node(targetTab, hash, key, value);
+        hashmap->count++;
+        hashmap->keyBytes += strlen(key) + 1;
     } 
     /* exist tab */
     else if (targetTab->root) {
@@ -126,6 +450,8 @@ static bool hashmap_put(struct HashMap * hashmap, char * key, void * value) {
         /* new node*/
         if(!targetNode) {
             targetTab->insert(targetTab, key, value);
+            hashmap->count++;
+            hashmap->keyBytes += strlen(key) + 1;
         } 
         else if (targetNode) {
             free(targetNode->value);
@@ -150,113 +476,79 @@ static void * hashmap_get(struct HashMap * hashmap, char * key) {
 	return (t = targetTab->search(targetTab, key)) ? t->value : NULL;
 }
 
+/**
+ * @brief put node "to" at the place of node "from" in the tree, fix the parent link
+ */
+static void tree_replace_child(struct Tree * tree, struct Tree_Node * from, struct Tree_Node * to) {
+    if(!from->root) tree->root = to;
+    else if(from->root->left == from) from->root->left = to;
+    else from->root->right = to;
+    if(to) to->root = from->root;
+}
 
-static struct Tree_Node * tree_delete_successor(struct Tree_Node * root, char * key) {
-      unsigned long hash = _hash(key);
-
-    if(strcmp(key, root->key)==0) {
-        /* leaf */
-        if(!root->right && !root->left) {
-            if(root->root) {
-                root->root->next = root->next;
-            }
-            free(root);
-            return NULL;
-        }
-
-        /* single child root */
-        else if ((!root->right && root->left) || (root->right && !root->left)) {
-            if(root->root) {
-                root->root->next = root->next;
-            }
-            struct Tree_Node * ret = root->right ? root->right : root->left;
-            free(root);           
-            return ret;
-        }
-        else {
-            printf("target is not successor!");
-            return NULL;
-        }
+/**
+ * @brief unlink a node from the tree and the tab list, the node itself is not freed
+ */
+static void tree_unlink(struct Tree * tree, struct Tree_Node * node) {
+    /* leaf or single child root */
+    if(!node->left) {
+        tree_replace_child(tree, node, node->right);
     }
-
+    else if(!node->right) {
+        tree_replace_child(tree, node, node->left);
+    }
+    /* tow children root, the successor takes the place of the node */
     else {
-        if(hash > root->hash) {
-            root->right = tree_delete_successor(root->right, key);
+        struct Tree_Node * minNode = node->right;
+        for(;minNode->left!=NULL;) {
+            minNode=minNode->left;
         }
-        else if (hash < root->hash){
-            root->left = tree_delete_successor(root->left, key);
-        } 
+        if(minNode->root != node) {
+            tree_replace_child(tree, minNode, minNode->right);
+            minNode->right = node->right;
+            minNode->right->root = minNode;
+        }
+        tree_replace_child(tree, node, minNode);
+        minNode->left = node->left;
+        minNode->left->root = minNode;
     }
-    return root;  
+
+    if(node->prev) node->prev->next = node->next;
+    else tree->head = node->next;
+    if(node->next) node->next->prev = node->prev;
 }
 
 /**
- * @brief delete a node from a tree, and return the root of the tree
+ * @brief remove a key_value from a hash map, and give the value back to the caller
+ * @param hashmap which hash map to opreate
+ * @param key the key in key_value
+ * @return void * the pointer of value, NULL if the key is not found
+ * @note the value is NOT freed, the caller owns it now.
  */
-static struct Tree_Node * tree_delete(struct Tree_Node * root, char * key) {
+static void * hashmap_remove(struct HashMap * hashmap, char * key) {
     unsigned long hash = _hash(key);
+    struct Tree * targetTab = &hashmap->tab[(HASH_TABLE_MAX_LENGTH-1) & hash];
+    if(!targetTab->root) return NULL;
 
-    if(strcmp(key, root->key)==0) {
-
-        /* leaf */
-        if(!root->right && !root->left) {
-            if(root->root) {
-                root->root->next = root->next;
-            }
-            free(root->value);
-            free(root->key);
-            free(root);
-            return NULL;
-        }
-
-        /* single child root */
-        else if ((!root->right && root->left) || (root->right && !root->left)) {
-            if(root->root) {
-                root->root->next = root->next;
-            }
-            struct Tree_Node * ret = root->right ? root->right : root->left;
-            free(root->value);
-            free(root->key);
-            free(root);           
-            return ret;
-        }
-
-        /* tow children root , delete root and recursion each childre find another root */
-        else if (root->right && root->left) {
-            /*  find successor  */
-            struct Tree_Node * minNode = root->right;
-            for(;minNode->left!=NULL;) {
-                minNode=minNode->left;
-            }
-            root->hash = minNode->hash;
-            root->key = minNode->key;
-            root->value = minNode->value;
-
-            /* delete successor */
-            root->right = tree_delete_successor(root->right, minNode->key);
-        }
-    }
+    struct Tree_Node * target = targetTab->search(targetTab, key);
+    if(!target) return NULL;
 
-    else {
-        if(hash > root->hash) {
-            root->right = tree_delete(root->right, key);
-        }
-        else if (hash < root->hash){
-            root->left = tree_delete(root->left, key);
-        } 
-    }
-    return root;
+    void * value = target->value;
+    tree_unlink(targetTab, target);
+    hashmap->count--;
+    hashmap->keyBytes -= strlen(target->key) + 1;
+    free(target->key);
+    free(target);
+    return value;
 }
 
 static bool hashmap_delete(struct HashMap * hashmap, char * key) {
-    unsigned long hash = _hash(key);
-    struct Tree * targetTab = &hashmap->tab[(HASH_TABLE_MAX_LENGTH-1) & hash];
-    struct Tree_Node * target = hashmap->get(hashmap, key);
-    if(!target) {
+    void * value = hashmap_remove(hashmap, key);
+    if(!value) {
         printf("can find delete target!");
         return false;
     }
-    targetTab->root = tree_delete(targetTab->root, key);
+    free(value);
 		return true;
 }
 
@@ -277,11 +569,11 @@ static void * hashmap_next(
         iterator->nowTab++;
         while(iterator->nowTab < HASH_TABLE_MAX_LENGTH){
             struct Tree * targetTab = &hashmap->tab[iterator->nowTab];
-            if(targetTab->root) {
-                iterator->nextNode = targetTab->root;
+            if(targetTab->head) {
+                iterator->nextNode = targetTab->head;
                 break;
             }
-            else if (!targetTab->root){
+            else if (!targetTab->head){
                 iterator->nowTab++;
                 continue;
             }
@@ -295,23 +587,32 @@ static bool hashmap_has_next(struct HashMap_Iterator * iterator) {
     return (bool)iterator->nextNode;
 }
 
-static struct HashMap_Iterator * hashmap_create_iterator(struct HashMap * hashmap) {
-    struct HashMap_Iterator * iterator = calloc(1, sizeof(struct HashMap_Iterator));
+/**
+ * @brief init a iterator in place, so the caller could keep it on the stack
+ *        and walk the hash map without any malloc.
+ */
+static void hashmap_init_iterator(struct HashMap * hashmap, struct HashMap_Iterator * iterator) {
+    memset(iterator, 0, sizeof(struct HashMap_Iterator));
     iterator->next = hashmap_next;
     iterator->hasNext = hashmap_has_next;
     iterator->nowTab = 0;
     /* move to the fisrt element */
     while(iterator->nowTab < HASH_TABLE_MAX_LENGTH){
         struct Tree * targetTab = &(hashmap->tab[iterator->nowTab]);
-        if(targetTab->root) {
-            iterator->nextNode = targetTab->root;
+        if(targetTab->head) {
+            iterator->nextNode = targetTab->head;
             break;
         }
-        else if (!targetTab->root){
+        else if (!targetTab->head){
             iterator->nowTab++;
             continue;
         }
     }
+}
+
+static struct HashMap_Iterator * hashmap_create_iterator(struct HashMap * hashmap) {
+    struct HashMap_Iterator * iterator = malloc(sizeof(struct HashMap_Iterator));
+    hashmap_init_iterator(hashmap, iterator);
     return iterator;
 }
 
@@ -325,13 +626,13 @@ static struct Tree_Node * tree_search(struct Tree * tree, char * key) {
     unsigned long hash = _hash(key);
     /* use iteration insteadof recursion*/
     for(struct Tree_Node * node = tree->root;;) {
-        if(strcmp(key, node->key) == 0) {
+        if(node == NULL) return NULL;
+        if(hash == node->hash && strcmp(key, node->key) == 0) {
             return node;
         }
         
         if(hash <= node->hash) node=node->left;
         else if (hash > node->hash) node=node->right;
-        if(node == NULL) return NULL;
     }
 }
 
@@ -347,17 +648,10 @@ static bool tree_insert(struct Tree * tree, char * key, void * value) {
     struct Tree_Node * last_node = NULL;
     for(struct Tree_Node * node = tree->root;;){
         if(node == NULL) {
-            node = (struct Tree_Node*)malloc(sizeof(struct Tree_Node));
-            node->hash = hash;
-            node->key = (char*)malloc(strlen(key));
-            strcpy(node->key, key);
-            node->left = NULL;
-            node->right = NULL;
+            node = tree_new_node(tree, hash, key, value);
             node->root = last_node;
-            node->value = value;
-            node->next = last_node->next;                                                                                            
-            last_node->next = node;
-            if(hash<last_node->hash) last_node->left = node;
+            /* same hash goes left, the same as tree_search */
+            if(hash<=last_node->hash) last_node->left = node;
             else if (hash>last_node->hash) last_node->right = node;
             return true;
         }
@@ -383,7 +677,11 @@ struct HashMap * New_HashMap(){
     hashmap->get = hashmap_get;
     hashmap->put = hashmap_put;
     hashmap->delete = hashmap_delete;
+    hashmap->remove = hashmap_remove;
     hashmap->createIterator = hashmap_create_iterator;
+    hashmap->initIterator = hashmap_init_iterator;
+    hashmap->count = 0;
+    hashmap->keyBytes = 0;
     hashmap->tab = (struct Tree*)malloc(HASH_TABLE_MAX_LENGTH * sizeof(struct Tree));
     memset(hashmap->tab, 0, HASH_TABLE_MAX_LENGTH * sizeof(struct Tree));
     return hashmap;
@@ -401,25 +699,418 @@ struct HashMap * New_HashMap(){
 
 struct MallocTrancerInfo {
     char position[MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION];  // 
-    uint32_t ptr_address;
+    uintptr_t ptr_address;
     int mallocCount;
     int freeCount;
+    size_t mallocBytes;
+    size_t freeBytes;
+    int corruptCount;
+    int invalidFreeCount;  /* counted at the free position */
+    int doubleFreeCount;   /* counted at the free position */
+    int untrackedCount;    /* blocks not stored in hashmapAddressAll because of the memory budget */
+    bool filterMatch;      /* scratch of takeFilteredSnapshot(), only valid under the lock */
+    /* the live blocks at the peak, valid if peakGeneration is the instance's, else they are the current ones */
+    uint32_t peakGeneration;
+    int peakLiveCount;
+    size_t peakLiveBytes;
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    uint32_t lifetimeHistogram[MALLOC_TRANCER_LIFETIME_BUCKETS];
+#endif
+#if MALLOC_TRANCER_ENABLE_SLAB
+    uint8_t slab;              /* index of slabTable + 1, 0 if none */
+    uint32_t slabWindow;       /* the instance window slabWindowMallocs counts in */
+    uint32_t slabWindowMallocs;
+    size_t slabCandidateSize;  /* majority vote of the malloc sizes */
+    uint32_t slabCandidateVotes;
+#endif
+#if MALLOC_TRANCER_ENABLE_SHM
+    uint32_t shmSlot;      /* slot in the shared memory + 1, 0 if none yet */
+#endif
+#if MALLOC_TRANCER_ENABLE_STREAM
+    uint32_t streamId;     /* site id in the stream + 1, 0 if none yet */
+    bool streamSent;       /* the SITE record is sent */
+#endif
+#if MALLOC_TRANCER_ENABLE_TREND
+    struct MallocTrancerInfo * trendNext;   /* list of the positions sampleTrend() visits */
+    bool trendActive;
+    uint8_t trendHead;
+    uint8_t trendCount;
+    uint32_t trendCountRing[MALLOC_TRANCER_TREND_LENGTH];
+    size_t trendBytesRing[MALLOC_TRANCER_TREND_LENGTH];
+    /* running sums of the window, x is the period index 0..trendCount-1 */
+    int64_t trendSumY;
+    int64_t trendSumXY;
+#endif
+};
+
+/* value of hashmapAddressAll, one for each live block */
+struct MallocTrancerAddressInfo {
+    struct MallocTrancerInfo * info;
+    uintptr_t address;
+    size_t size;
+    uint8_t owner;         /* index of ownerTable */
+    uint8_t pool;          /* 1 + the pool id of a pool block, it has no redzone, 0 for a heap block */
+    uint32_t epoch;        /* mark() epoch of the malloc */
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    uint32_t mallocTime;   /* LIFETIME_NOW() of the malloc */
+#endif
+#if MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+    /* node of the address ordered AVL tree */
+    struct MallocTrancerAddressInfo * left;
+    struct MallocTrancerAddressInfo * right;
+    int height;
+#endif
+};
+
+/* per owner (task/thread) totals, a small dense table */
+struct MallocTrancerOwnerInfo {
+    void * owner;
+    int mallocCount;
+    int freeCount;
+    size_t liveBytes;
+};
+
+#if MALLOC_TRANCER_MAX_OWNERS < 1 || MALLOC_TRANCER_MAX_OWNERS > 255
+#error "MALLOC_TRANCER_MAX_OWNERS must be 1..255"
+#endif
+
+/* counters of a fixed block pool, indexed by the pool id */
+struct MallocTrancerPoolInfo {
+    struct MallocTrancerPool pool;
+    unsigned long sampleGetCount;   /* getCount at the last samplePools() */
+};
+
+#if MALLOC_TRANCER_MAX_POOLS < 1 || MALLOC_TRANCER_MAX_POOLS > 254
+#error "MALLOC_TRANCER_MAX_POOLS must be 1..254"
+#endif
+
+/* one writer per slot: the ring's producer in deferred mode, else the lock holder */
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+#define PROFILE_SLOT_COUNT MALLOC_TRANCER_RING_COUNT
+#define PROFILE_SLOT() MALLOC_TRANCER_CURRENT_RING()
+#else
+#define PROFILE_SLOT_COUNT 1
+#define PROFILE_SLOT() 0
+#endif
+
+#define PROFILE_MALLOC 0
+#define PROFILE_FREE   1
+
+struct MallocTrancerProfileSlot {
+    uint32_t histogram[2][MALLOC_TRANCER_PROFILE_BUCKETS];
+    uint32_t max[2];
+};
+
+#if MALLOC_TRANCER_ENABLE_SLAB
+#if MALLOC_TRANCER_ENABLE_DEFERRED || MALLOC_TRANCER_ENABLE_REDZONE
+#error "MALLOC_TRANCER_ENABLE_SLAB can not be used with MALLOC_TRANCER_ENABLE_DEFERRED or MALLOC_TRANCER_ENABLE_REDZONE"
+#endif
+#if MALLOC_TRANCER_SLAB_MAX_SITES < 1 || MALLOC_TRANCER_SLAB_MAX_SITES > 255
+#error "MALLOC_TRANCER_SLAB_MAX_SITES must be 1..255"
+#endif
+
+/* one slab: a backend block cut into blockCount blocks, the free ones in a list */
+struct MallocTrancerSlabInfo {
+    struct MallocTrancerInfo * info;
+    uint8_t * base;
+    size_t blockSize;
+    int blockCount;
+    int inUse;
+    void * freeList;          /* a free block holds the next one in its first bytes */
+    unsigned long hitCount;
+    unsigned long missCount;
+};
+#endif
+
+/* ring of the last frees, to tell a double free from a foreign pointer */
+struct MallocTrancerRecentFree {
+    uintptr_t address;
+    struct MallocTrancerInfo * info;
 };
 
+/* two buffers, so a new snapshot can be taken while the last one is still read */
+struct MallocTrancerSnapshotBuffer {
+    struct MallocTrancerSnapshot snapshot;    /* first, releaseSnapshot() casts back */
+    size_t siteCapacity;
+    size_t allocationCapacity;
+    bool busy;
+    struct MallocTrancerOwner owners[MALLOC_TRANCER_MAX_OWNERS];
+    struct MallocTrancerPool pools[MALLOC_TRANCER_MAX_POOLS];
+    struct MallocTrancerPeakSite peakSites[MALLOC_TRANCER_PEAK_REPORT_LENGTH];
+#if MALLOC_TRANCER_ENABLE_SLAB
+    struct MallocTrancerSlab slabs[MALLOC_TRANCER_SLAB_MAX_SITES];
+#endif
+};
+
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+/* fixed size event, the hot path only copies one of these into a ring */
+struct MallocTrancerEvent {
+    uint32_t seq;
+    uint8_t type;
+    void * ptr;
+    size_t size;
+    struct MallocTrancerInfo * site;   /* from _trace_site(), NULL to look the position up by file/func/line */
+    const char * file;
+    const char * func;
+    long line;
+    void * owner;
+    uint32_t epoch;
+    uint32_t time;    /* LIFETIME_NOW() of the push, drain() may run much later */
+    uint8_t pool;     /* pool id + 1, 0 for a heap block */
+};
+
+/* single producer (one core or one interrupt level) / single consumer (drain) ring */
+struct MallocTrancerRing {
+    uint32_t head;    /* written by the producer only */
+    uint32_t tail;    /* written by drain only */
+    uint32_t dropCount;
+    struct MallocTrancerEvent events[MALLOC_TRANCER_RING_LENGTH];
+};
+#endif
+
+/* one traced heap with its own backend and tables, New_MallocTrancer() is the one on malloc/free */
+struct MallocTrancerInstance {
+    struct MallocTrancer tracer;   /* first, the methods cast it back */
+    struct MallocTrancerInstance * next;
+    MALLOC_TRANCER_LOCK_TYPE lock;   /* the tables below */
+    const char * name;
+    void * (*backendMalloc)(size_t size);
+    void (*backendFree)(void * ptr);
+    size_t capacity;
+    struct HashMap * hashmapPositionAll;
+    struct HashMap * hashmapAddressAll;
+    struct MallocTrancerRecentFree recentFree[MALLOC_TRANCER_RECENT_FREE_LENGTH];
+    int recentFreeIndex;
+    int invalidFreeCount;
+    int doubleFreeCount;
+    unsigned long unmatchedFreeCount;   /* frees of unknown blocks after events were dropped, not counted as bad */
+    unsigned long staleBlockCount;      /* blocks still in the table when their address was malloc again */
+    struct MallocTrancerOwnerInfo ownerTable[MALLOC_TRANCER_MAX_OWNERS];
+    int ownerCount;
+    int ownerLast;
+    struct MallocTrancerPoolInfo poolTable[MALLOC_TRANCER_MAX_POOLS];
+    int poolCount;
+    size_t liveBytesAll;
+    size_t liveOverheadBytes;   /* heap_overhead() of the blocks in liveBytesAll */
+    size_t livePoolBytes;       /* the pool blocks in liveBytesAll, they are not on the heap */
+    size_t peakBytes;           /* high water of liveBytesAll */
+    uint32_t peakGeneration;    /* counts the new peaks */
+    uint32_t peakTime;
+    long heapHistory[MALLOC_TRANCER_HEAP_HISTORY];   /* untraced bytes of the sampleHeap() periods */
+    uint8_t heapHistoryHead;
+    uint8_t heapHistoryCount;
+    uint32_t currentEpoch;
+    size_t memoryBudget;
+    struct MallocTrancerInfo otherInfo;
+    uintptr_t untrackedSet[MALLOC_TRANCER_UNTRACKED_LENGTH];
+    unsigned long untrackedLive;   /* in untrackedSet */
+    unsigned long untrackedFreeCount;
+    unsigned long droppedAddressCount;
+    unsigned long collapsedSiteCount;
+#if MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+    struct MallocTrancerAddressInfo * addressIndexRoot;
+    uintptr_t heapStart;
+    uintptr_t heapEnd;
+#endif
+#if MALLOC_TRANCER_ENABLE_REDZONE
+    int redzoneCorruptCount;
+#endif
+    struct MallocTrancerSnapshotBuffer snapshotBuffer[2];
+    unsigned long snapshotGeneration;
+#if MALLOC_TRANCER_ENABLE_TREND
+    /* the positions with live bytes in the window, so a sample is O(active positions) */
+    struct MallocTrancerInfo * trendList;
+#endif
+#if MALLOC_TRANCER_ENABLE_STREAM
+    MallocTrancerSink streamSink;
+    void * streamContext;
+    uint32_t streamSiteCount;
+    uint32_t streamTime;
+    uintptr_t streamAddress;
+    bool streamSync;
+    unsigned long streamDropCount;
+#endif
+#if MALLOC_TRANCER_ENABLE_SHM
+    struct MallocTrancerShm * shmRegion;
+#endif
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+    struct MallocTrancerRing eventRing[MALLOC_TRANCER_RING_COUNT];
+#endif
+#if MALLOC_TRANCER_ENABLE_PROFILE
+    struct MallocTrancerProfileSlot profile[PROFILE_SLOT_COUNT];
+#endif
+#if MALLOC_TRANCER_ENABLE_SLAB
+    struct MallocTrancerSlabInfo slabTable[MALLOC_TRANCER_SLAB_MAX_SITES];
+    int slabCount;
+    uint32_t slabWindow;           /* counts the windows of MALLOC_TRANCER_SLAB_WINDOW mallocs */
+    uint32_t slabWindowMallocs;
+#endif
+};
+
+#define INSTANCE(tracer) ((struct MallocTrancerInstance*)(tracer))
+
+#if MALLOC_TRANCER_ENABLE_LIFETIME && defined(LIFETIME_CLOCK_MONOTONIC)
+STATIC uint32_t utils_monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u);
+}
+#endif
+
 STATIC bool is_init = false;
-STATIC struct MallocTrancer mallocTrancer;
-STATIC struct HashMap * hashmapPositionAll;
-STATIC struct HashMap * hashmapAddressAll;
+STATIC struct MallocTrancerInstance defaultInstance;
+/* all the instances, for the combined report and the aggregator */
+STATIC struct MallocTrancerInstance * instanceList = NULL;
+
+STATIC char * getMallocInfo(struct MallocTrancer * tracer);
+STATIC int topSites(struct MallocTrancer * tracer, enum MallocTrancerMetric metric, int n, struct MallocTrancerSite * out);
+STATIC int topLiveAllocations(struct MallocTrancer * tracer, int n, struct MallocTrancerAllocation * out);
+STATIC int checkAll(struct MallocTrancer * tracer);
+STATIC void setHeapRange(struct MallocTrancer * tracer, uintptr_t start, uintptr_t end);
+STATIC bool getFragmentation(struct MallocTrancer * tracer, struct MallocTrancerFragmentation * out);
+STATIC bool findOwner(struct MallocTrancer * tracer, uintptr_t address, struct MallocTrancerAllocation * out);
+STATIC int getOwners(struct MallocTrancer * tracer, int n, struct MallocTrancerOwner * out);
+STATIC const char * owner_name(struct MallocTrancer * tracer, void * owner, char * buffer, size_t length);
+STATIC uint32_t mark(struct MallocTrancer * tracer);
+STATIC int liveSince(struct MallocTrancer * tracer, uint32_t epoch, int n, struct MallocTrancerAllocation * out);
+STATIC int drain(struct MallocTrancer * tracer);
+STATIC void getMemoryUsage(struct MallocTrancer * tracer, struct MallocTrancerMemory * out);
+STATIC void utils_memory_usage(struct MallocTrancerInstance * self, struct MallocTrancerMemory * out);
+STATIC bool openShm(struct MallocTrancer * tracer, const char * name);
+STATIC void setMemoryBudget(struct MallocTrancer * tracer, size_t bytes);
+STATIC unsigned long getDropCount(struct MallocTrancer * tracer);
+STATIC bool startAggregator(struct MallocTrancer * tracer, unsigned int periodMs);
+STATIC struct MallocTrancerSnapshot * takeSnapshot(struct MallocTrancer * tracer);
+STATIC void releaseSnapshot(struct MallocTrancer * tracer, struct MallocTrancerSnapshot * snapshot);
+STATIC struct MallocTrancerSnapshot * takeFilteredSnapshot(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter);
+STATIC char * getFilteredInfo(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter);
+STATIC bool sendFilteredReport(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter);
+STATIC bool writePprof(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context);
+STATIC bool writeReport(struct MallocTrancer * tracer, enum MallocTrancerFormat format,
+        const struct MallocTrancerFilter * filter, MallocTrancerSink sink, void * context);
+STATIC void sampleTrend(struct MallocTrancer * tracer);
+STATIC void setEventStream(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context);
+STATIC void setTransport(struct MallocTrancer * tracer, struct MallocTrancerTransport * transport);
+STATIC bool transportSink(const void * data, size_t length, void * context);
+STATIC size_t flushTransport(struct MallocTrancer * tracer);
+STATIC bool sendReport(struct MallocTrancer * tracer);
+STATIC bool openFileTransport(struct MallocTrancer * tracer, const char * path, enum MallocTrancerPolicy policy);
+STATIC unsigned long getStreamDropCount(struct MallocTrancer * tracer);
+STATIC int suspectedLeaks(struct MallocTrancer * tracer, int n, struct MallocTrancerLeak * out);
+STATIC int addPool(struct MallocTrancer * tracer, const char * name, size_t blockSize, int capacity);
+STATIC int getPools(struct MallocTrancer * tracer, int n, struct MallocTrancerPool * out);
+STATIC void samplePools(struct MallocTrancer * tracer);
+STATIC void getProfile(struct MallocTrancer * tracer, struct MallocTrancerProfile * out);
+STATIC int getSlabs(struct MallocTrancer * tracer, int n, struct MallocTrancerSlab * out);
+STATIC int getPeak(struct MallocTrancer * tracer, struct MallocTrancerPeak * peak, int n, struct MallocTrancerPeakSite * out);
+STATIC void resetPeak(struct MallocTrancer * tracer);
+STATIC void sampleHeap(struct MallocTrancer * tracer);
+STATIC bool getHeapStats(struct MallocTrancer * tracer, struct MallocTrancerHeapStats * out);
+STATIC void heap_stats(struct MallocTrancer * tracer, struct MallocTrancerHeapStats * out);
+STATIC size_t heap_overhead(size_t size);
+#if MALLOC_TRANCER_HEAP_STATS
+STATIC size_t heap_used_default(void);
+#endif
+STATIC bool filter_position(const struct MallocTrancerFilter * filter, const struct MallocTrancerInfo * info);
+#if MALLOC_TRANCER_ENABLE_SLAB
+STATIC int slab_fill(struct MallocTrancerInstance * self, const struct MallocTrancerFilter * filter, int n, struct MallocTrancerSlab * out);
+#endif
+#if MALLOC_TRANCER_ENABLE_PROFILE
+STATIC void profile_fill(struct MallocTrancerInstance * self, int op, struct MallocTrancerLatency * out);
+#endif
+
+STATIC void instance_init(struct MallocTrancerInstance * self, const struct MallocTrancerHeapConfig * config) {
+    struct MallocTrancer * tracer = &self->tracer;
+    tracer->getMallocInfo = getMallocInfo;
+    tracer->topSites = topSites;
+    tracer->topLiveAllocations = topLiveAllocations;
+    tracer->checkAll = checkAll;
+    tracer->setHeapRange = setHeapRange;
+    tracer->getFragmentation = getFragmentation;
+    tracer->findOwner = findOwner;
+    tracer->getOwners = getOwners;
+    tracer->mark = mark;
+    tracer->liveSince = liveSince;
+    tracer->drain = drain;
+    tracer->getDropCount = getDropCount;
+    tracer->startAggregator = startAggregator;
+    tracer->getMemoryUsage = getMemoryUsage;
+    tracer->setMemoryBudget = setMemoryBudget;
+    tracer->openShm = openShm;
+    tracer->takeSnapshot = takeSnapshot;
+    tracer->releaseSnapshot = releaseSnapshot;
+    tracer->takeFilteredSnapshot = takeFilteredSnapshot;
+    tracer->getFilteredInfo = getFilteredInfo;
+    tracer->sendFilteredReport = sendFilteredReport;
+    tracer->writePprof = writePprof;
+    tracer->writeReport = writeReport;
+    tracer->sampleTrend = sampleTrend;
+    tracer->setEventStream = setEventStream;
+    tracer->setTransport = setTransport;
+    tracer->transportSink = transportSink;
+    tracer->flushTransport = flushTransport;
+    tracer->sendReport = sendReport;
+    tracer->openFileTransport = openFileTransport;
+    tracer->getStreamDropCount = getStreamDropCount;
+    tracer->suspectedLeaks = suspectedLeaks;
+    tracer->addPool = addPool;
+    tracer->getPools = getPools;
+    tracer->samplePools = samplePools;
+    tracer->getProfile = getProfile;
+    tracer->getSlabs = getSlabs;
+    tracer->getPeak = getPeak;
+    tracer->resetPeak = resetPeak;
+    tracer->sampleHeap = sampleHeap;
+    tracer->getHeapStats = getHeapStats;
+    self->name = config->name ? config->name : "heap";
+    self->backendMalloc = config->malloc ? config->malloc : malloc;
+    self->backendFree = config->free ? config->free : free;
+#if MALLOC_TRANCER_HEAP_STATS
+    /* the built in counts are of the malloc heap only */
+    if(self->backendMalloc == malloc) tracer->heapUsed = heap_used_default;
+#endif
+    self->capacity = config->capacity;
+    self->memoryBudget = config->memoryBudget;
+    self->hashmapPositionAll = New_HashMap();
+    self->hashmapAddressAll = New_HashMap();
+    /* the position all new positions fall into once the memory budget is used up */
+    strlcpy(self->otherInfo.position, "(other)", MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
+#if MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+    self->heapStart = MALLOC_TRANCER_HEAP_START;
+    self->heapEnd = MALLOC_TRANCER_HEAP_END;
+#endif
+
+    MALLOC_TRANCER_LOCK_INIT(&self->lock);
+    /* every instance, New_MallocTrancerHeap() may be the only one made; it only sets enable bits */
+    MALLOC_TRANCER_CYCLES_INIT();
 
-STATIC char * getMallocInfo(void);
+    /* the instances are made at start up, the new one is published complete for the list walkers */
+    struct MallocTrancerInstance ** link = &instanceList;
+    while(*link) link = &(*link)->next;
+    MALLOC_TRANCER_STORE_RELEASE(link, self);
+}
 
+/**
+ * @brief the default instance, on malloc/free, for trace_malloc/trace_free
+ */
 struct MallocTrancer * New_MallocTrancer(void) {
     if(!is_init) {
-        mallocTrancer.getMallocInfo = getMallocInfo; 
-        hashmapPositionAll = New_HashMap();
-        hashmapAddressAll = New_HashMap();
+        struct MallocTrancerHeapConfig config = { "default", malloc, free, 0, MALLOC_TRANCER_MEMORY_BUDGET };
+        instance_init(&defaultInstance, &config);
+        is_init = true;
     }
-    return &mallocTrancer;
+    return &defaultInstance.tracer;
+}
+
+/**
+ * @brief a instance for one more heap, with its own backend and tables, for trace_heap_malloc/trace_heap_free
+ * @return NULL if out of memory
+ */
+struct MallocTrancer * New_MallocTrancerHeap(const struct MallocTrancerHeapConfig * config) {
+    struct MallocTrancerInstance * self = calloc(1, sizeof(struct MallocTrancerInstance));
+    if(!self) return NULL;
+    instance_init(self, config);
+    return &self->tracer;
 }
 
 #define TABLE1_HEADER \
@@ -432,12 +1123,35 @@ struct MallocTrancer * New_MallocTrancer(void) {
 "\r\n TABLE2: ADDRESS-POSITION                                                                            |"\
 "\r\n                                                                                                     |"
 
+#define TABLE3_HEADER \
+"\r\n -----------------------------------------------------------------------------------------------------"\
+"\r\n TABLE3: BAD FREE POSITION                                                                           |"\
+"\r\n                                                                                                     |"
+
+#define TABLE4_HEADER \
+"\r\n -----------------------------------------------------------------------------------------------------"\
+"\r\n TABLE4: OWNER                                                                                       |"\
+"\r\n                                                                                                     |"
+
+#define TABLE5_HEADER \
+"\r\n -----------------------------------------------------------------------------------------------------"\
+"\r\n TABLE5: POOL                                                                                        |"\
+"\r\n                                                                                                     |"
+
+#define TABLE6_HEADER \
+"\r\n -----------------------------------------------------------------------------------------------------"\
+"\r\n TABLE6: LIFETIME                                                                                    |"\
+"\r\n                                                                                                     |"
+
+#define TABLE_FOOTER \
+"\r\n -----------------------------------------------------------------------------------------------------"
 
 STATIC char * utils_add_table1_line(char * targetStr, char * position, char * address, char * mallocCount, char * freeCount){
     char * temp;
-    temp = (char*)malloc(strlen("\r\n  |  |  |       |")+64+10+5+5);
+    int len = snprintf(NULL, 0, "\r\n %-64s | %-10s | %6s | %5s      |", position, address, mallocCount, freeCount);
+    temp = (char*)malloc(len + 1);
     sprintf(temp, "\r\n %-64s | %-10s | %6s | %5s      |", position, address, mallocCount, freeCount);
-    targetStr = (char*)realloc(targetStr, strlen(targetStr) + strlen(temp));
+    targetStr = (char*)realloc(targetStr, strlen(targetStr) + len + 1);
     strcat(targetStr, temp);
     free(temp);
 	  return targetStr;
@@ -445,122 +1159,3136 @@ STATIC char * utils_add_table1_line(char * targetStr, char * position, char * ad
                                                         
 STATIC char * utils_add_table2_line(char * targetStr, char * address, char * position){
     char * temp;
-    temp = (char*)malloc(strlen("\r\n  |                        |")+64+10);
+    int len = snprintf(NULL, 0, "\r\n %-10s | %-64s                       |", address, position);
+    temp = (char*)malloc(len + 1);
     sprintf(temp, "\r\n %-10s | %-64s                       |", address, position);
-    targetStr = (char*)realloc(targetStr, strlen(targetStr) + strlen(temp));
+    targetStr = (char*)realloc(targetStr, strlen(targetStr) + len + 1);
     strcat(targetStr, temp);
     free(temp);
 	  return targetStr;
 }                                                            
 
-STATIC char * getMallocInfo(void){
-    struct HashMap_Iterator * iteratorPosition = hashmapPositionAll->createIterator(hashmapPositionAll);
-    char * table1Str = (char*)malloc(strlen(TABLE1_HEADER));
+/**
+ * @brief printf to the end of targetStr, targetStr is realloc to fit
+ */
+STATIC char * utils_append(char * targetStr, const char * format, ...){
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    size_t oldLen = strlen(targetStr);
+    targetStr = (char*)realloc(targetStr, oldLen + len + 1);
+    va_start(args, format);
+    vsnprintf(targetStr + oldLen, len + 1, format, args);
+    va_end(args);
+    return targetStr;
+}
+
+STATIC char * getMallocInfo(struct MallocTrancer * tracer){
+    return getFilteredInfo(tracer, NULL);
+}
+
+/**
+ * @brief format the report from a snapshot, so the tracing side is only
+ *        blocked while the tables are copied, not while they are printed.
+ *        the rows the filter drops are not even copied.
+ * @return NULL if no snapshot could be taken
+ */
+STATIC char * getFilteredInfo(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter){
+    struct MallocTrancerSnapshot * snapshot = takeFilteredSnapshot(tracer, filter);
+    if(!snapshot) return NULL;
+
+    char * table1Str = (char*)malloc(strlen(TABLE1_HEADER) + 1);
     strcpy(table1Str, TABLE1_HEADER);
 
     table1Str = utils_add_table1_line(table1Str, "POSITION", "ADDRESS" , "MALLOC", "FREE");
 
-    while(iteratorPosition->hasNext(iteratorPosition)){
-        struct Tree_Node * node = (struct Tree_Node*)iteratorPosition->next(iteratorPosition, hashmapPositionAll);
-        struct MallocTrancerInfo * info = (struct MallocTrancerInfo*)node->value;
-        char ptr_address[10] = "";
-        sprintf(ptr_address, "%#lX", (unsigned long)info->ptr_address);
-				char mallocCount[10] = "";
-        sprintf(mallocCount, "%d", info->mallocCount);
+    for(int i = 0; i < snapshot->siteCount; i++) {
+        struct MallocTrancerSite * site = &snapshot->sites[i];
+        char ptr_address[24] = "";
+        sprintf(ptr_address, "%#lX", (unsigned long)site->lastAddress);
+				char mallocCount[12] = "";
+        sprintf(mallocCount, "%d", site->mallocCount);
 
-				char freeCount[10] = "";
-        sprintf(freeCount, "%d", info->freeCount);
+				char freeCount[12] = "";
+        sprintf(freeCount, "%d", site->freeCount);
 
-        table1Str = utils_add_table1_line(table1Str, info->position, ptr_address, mallocCount, freeCount);
+        table1Str = utils_add_table1_line(table1Str, (char*)site->position, ptr_address, mallocCount, freeCount);
     } 
-    free(iteratorPosition);
 
     
-    table1Str = (char*)realloc(table1Str, strlen(table1Str) + strlen(TABLE2_HEADER));
+    table1Str = (char*)realloc(table1Str, strlen(table1Str) + strlen(TABLE2_HEADER) + 1);
     strcat(table1Str, TABLE2_HEADER);
 
     table1Str = utils_add_table2_line(table1Str, "ADDRESS", "POSITION");
 
-    struct HashMap_Iterator * iteratorAddress = hashmapAddressAll->createIterator(hashmapAddressAll);
-    while(iteratorAddress->hasNext(iteratorAddress)){
-        struct Tree_Node * node = (struct Tree_Node*)iteratorAddress->next(iteratorAddress, hashmapAddressAll);
-        char * address = (char*)node->key;
-        char ptr_address[10] = "";
-        sprintf(ptr_address, "%#lX", (unsigned long)address);
-        table1Str = utils_add_table2_line(table1Str, ptr_address, node->value);
+    for(int i = 0; i < snapshot->allocationCount; i++) {
+        char address[24] = "";
+        sprintf(address, "%#lX", (unsigned long)snapshot->allocations[i].address);
+        table1Str = utils_add_table2_line(table1Str, address, (char*)snapshot->allocations[i].position);
     } 
 
-    strcat(table1Str, "\r\n -----------------------------------------------------------------------------------------------------");
-    free(iteratorAddress);
-    return table1Str;
-}
+    if(snapshot->invalidFreeCount || snapshot->doubleFreeCount) {
+        table1Str = utils_append(table1Str, "%s", TABLE3_HEADER);
+        table1Str = utils_append(table1Str, "\r\n %-64s | %-12s | %-12s     |", "POSITION", "INVALID FREE", "DOUBLE FREE");
+        for(int i = 0; i < snapshot->siteCount; i++) {
+            struct MallocTrancerSite * site = &snapshot->sites[i];
+            if(!site->invalidFreeCount && !site->doubleFreeCount) continue;
+            table1Str = utils_append(table1Str, "\r\n %-64s | %12d | %12d     |", site->position, site->invalidFreeCount, site->doubleFreeCount);
+        }
+    }
 
-void * _trace_malloc(size_t size,  const char *file, const char *func,const long line) {
-    void * ret = malloc(size);
-    uint32_t address = (uint32_t)ret;
-    char addressStr[16] = "";
-    snprintf(addressStr, sizeof(addressStr), "%#X", address);
-    if(!ret) {
-        //log_w("malloc fail!");
-        return ret;
+    if(tracer->currentOwner) {
+        table1Str = utils_append(table1Str, "%s", TABLE4_HEADER);
+        table1Str = utils_append(table1Str, "\r\n %-32s | %-10s | %-10s | %-12s                          |", "OWNER", "MALLOC", "FREE", "LIVE BYTES");
+        for(int i = 0; i < snapshot->ownerCount; i++) {
+            struct MallocTrancerOwner * owner = &snapshot->owners[i];
+            char buffer[24];
+            const char * name = (i == MALLOC_TRANCER_MAX_OWNERS - 1) ? "(others)" : owner_name(tracer, owner->owner, buffer, sizeof(buffer));
+            table1Str = utils_append(table1Str, "\r\n %-32.32s | %10d | %10d | %12lu                          |",
+                    name, owner->mallocCount, owner->freeCount, (unsigned long)owner->liveBytes);
+        }
+    }
+
+    if(snapshot->poolCount) {
+        table1Str = utils_append(table1Str, "%s", TABLE5_HEADER);
+        table1Str = utils_append(table1Str, "\r\n %-22s | %-6s | %-8s | %-8s | %-8s | %-10s | %-6s | %-10s |",
+                "POOL", "BLOCK", "CAPACITY", "IN USE", "PEAK", "GET", "FAIL", "GET/SAMPLE");
+        for(int i = 0; i < snapshot->poolCount; i++) {
+            struct MallocTrancerPool * pool = &snapshot->pools[i];
+            table1Str = utils_append(table1Str, "\r\n %-22.22s | %6lu | %8d | %8d | %8d | %10lu | %6lu | %10lu |",
+                    pool->name, (unsigned long)pool->blockSize, pool->capacity, pool->inUse, pool->peakInUse,
+                    pool->getCount, pool->failCount, pool->getsPerSample);
+        }
+    }
+
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    table1Str = utils_append(table1Str, "%s", TABLE6_HEADER);
+    table1Str = utils_append(table1Str, "\r\n %-64s | %-32s |", "POSITION", "LOG2 LIFETIME:FREES");
+    for(int i = 0; i < snapshot->siteCount; i++) {
+        struct MallocTrancerSite * site = &snapshot->sites[i];
+        if(!site->freeCount) continue;
+        char histogram[33] = "";
+        size_t used = 0;
+        for(int b = 0; b < MALLOC_TRANCER_LIFETIME_BUCKETS && used < sizeof(histogram); b++) {
+            if(!site->lifetimeHistogram[b]) continue;
+            used += snprintf(histogram + used, sizeof(histogram) - used, "%s%d:%lu", used ? " " : "", b, (unsigned long)site->lifetimeHistogram[b]);
+        }
+        table1Str = utils_append(table1Str, "\r\n %-64s | %-32.32s |", site->position, histogram);
+    }
+#endif
+
+    struct MallocTrancerMemory * memory = &snapshot->memory;
+    table1Str = utils_append(table1Str, "%s", TABLE_FOOTER);
+    table1Str = utils_append(table1Str, "\r\n TRACER MEMORY: %lu bytes (site %lu, address %lu, node %lu, key %lu), TRACED: %lu bytes",
+            (unsigned long)memory->totalBytes, (unsigned long)memory->siteBytes, (unsigned long)memory->addressBytes,
+            (unsigned long)memory->nodeBytes, (unsigned long)memory->keyBytes, (unsigned long)memory->tracedBytes);
+    if(memory->budget) {
+        table1Str = utils_append(table1Str, "\r\n BUDGET: %lu bytes, untracked blocks %lu, untracked frees %lu, positions to (other) %lu",
+                (unsigned long)memory->budget, memory->droppedAddressCount, memory->untrackedFreeCount, memory->collapsedSiteCount);
+    }
+
+    struct MallocTrancerHeapStats * heap = &snapshot->heap;
+    if(heap->usedBytes) {
+        table1Str = utils_append(table1Str, "\r\n HEAP USED: %lu bytes = traced %lu + overhead %lu + tracer %lu + untraced %ld",
+                (unsigned long)heap->usedBytes, (unsigned long)heap->tracedBytes, (unsigned long)heap->overheadBytes,
+                (unsigned long)heap->tracerBytes, heap->untracedBytes);
+        if(heap->samples > 1) {
+            table1Str = utils_append(table1Str, ", untraced %ld..%ld, %+ld over %d samples",
+                    heap->untracedMin, heap->untracedMax, heap->untracedGrowth, heap->samples);
+        }
+    }
+
+    table1Str = utils_append(table1Str, "\r\n PEAK: %lu bytes, time %lu", (unsigned long)snapshot->peakBytes, (unsigned long)snapshot->peakTime);
+    for(int i = 0; i < snapshot->peakSiteCount; i++) {
+        struct MallocTrancerPeakSite * peakSite = &snapshot->peakSites[i];
+        table1Str = utils_append(table1Str, "\r\n PEAK POSITION: %s, %d blocks, %lu bytes",
+                peakSite->position, peakSite->liveCount, (unsigned long)peakSite->liveBytes);
+    }
+
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+    table1Str = utils_append(table1Str, "\r\n DEFERRED EVENTS DROPPED: %lu", snapshot->droppedEventCount);
+    if(snapshot->droppedEventCount) {
+        table1Str = utils_append(table1Str, ", THE TABLES ARE INCOMPLETE, frees of unknown blocks %lu", snapshot->unmatchedFreeCount);
+    }
+#endif
+    if(snapshot->staleBlockCount) {
+        table1Str = utils_append(table1Str, "\r\n STALE BLOCKS: %lu, their free was lost", snapshot->staleBlockCount);
+    }
+
+#if MALLOC_TRANCER_ENABLE_SLAB
+    for(int i = 0; i < snapshot->slabCount; i++) {
+        struct MallocTrancerSlab * slab = &snapshot->slabs[i];
+        table1Str = utils_append(table1Str, "\r\n SLAB: %s, %lu x %d bytes, in use %d, hit %lu, miss %lu",
+                slab->position, (unsigned long)slab->blockSize, slab->blockCount, slab->inUse,
+                slab->hitCount, slab->missCount);
+    }
+#endif
+
+#if MALLOC_TRANCER_ENABLE_PROFILE
+    struct MallocTrancerProfile * profile = &snapshot->profile;
+    table1Str = utils_append(table1Str, "\r\n TRACER LATENCY (cycles): malloc p50 %lu p99 %lu max %lu of %lu, free p50 %lu p99 %lu max %lu of %lu",
+            (unsigned long)profile->malloc.p50, (unsigned long)profile->malloc.p99, (unsigned long)profile->malloc.max, profile->malloc.count,
+            (unsigned long)profile->free.p50, (unsigned long)profile->free.p99, (unsigned long)profile->free.max, profile->free.count);
+#endif
+
+    table1Str = (char*)realloc(table1Str, strlen(table1Str) + strlen(TABLE_FOOTER) + 1);
+    strcat(table1Str, TABLE_FOOTER);
+    releaseSnapshot(tracer, snapshot);
+    return table1Str;
+}
+
+/**
+ * @brief the report of every heap, each after a line with its name, capacity and live bytes
+ * @return NULL if no report could be made
+ */
+char * MallocTrancer_getAllInfo(void) {
+    char * allStr = (char*)malloc(1);
+    if(!allStr) return NULL;
+    allStr[0] = '\0';
+    /* instances are only ever added, at the end, so the list can be walked without the lock */
+    for(struct MallocTrancerInstance * self = instanceList; self; self = self->next) {
+        MALLOC_TRANCER_LOCK(&self->lock);
+        size_t liveBytes = self->liveBytesAll - self->livePoolBytes;
+        MALLOC_TRANCER_UNLOCK(&self->lock);
+        allStr = utils_append(allStr, "\r\n HEAP: %s, live %lu bytes", self->name, (unsigned long)liveBytes);
+        if(self->capacity) {
+            allStr = utils_append(allStr, " of %lu (%lu%%)", (unsigned long)self->capacity,
+                    (unsigned long)(liveBytes * 100 / self->capacity));
+        }
+        char * info = getMallocInfo(&self->tracer);
+        if(!info) {
+            free(allStr);
+            return NULL;
+        }
+        allStr = utils_append(allStr, "%s", info);
+        free(info);
+    }
+    return allStr;
+}
+
+/* ===================== top N query =================================*/
+
+STATIC void utils_fill_allocation(struct MallocTrancerInstance * self, struct MallocTrancerAllocation * out, struct MallocTrancerAddressInfo * addressInfo) {
+    out->address = addressInfo->address;
+    out->size = addressInfo->size;
+    out->position = addressInfo->info->position;
+    out->owner = self->ownerTable[addressInfo->owner].owner;
+    out->epoch = addressInfo->epoch;
+}
+
+STATIC void utils_fill_site(struct MallocTrancerSite * out, struct MallocTrancerInfo * info) {
+    out->position = info->position;
+    out->mallocCount = info->mallocCount;
+    out->freeCount = info->freeCount;
+    out->mallocBytes = info->mallocBytes;
+    out->liveBytes = info->mallocBytes - info->freeBytes;
+    out->lastAddress = info->ptr_address;
+    out->invalidFreeCount = info->invalidFreeCount;
+    out->doubleFreeCount = info->doubleFreeCount;
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    memcpy(out->lifetimeHistogram, info->lifetimeHistogram, sizeof(out->lifetimeHistogram));
+#else
+    memset(out->lifetimeHistogram, 0, sizeof(out->lifetimeHistogram));
+#endif
+}
+
+STATIC size_t utils_site_metric(const struct MallocTrancerSite * site, enum MallocTrancerMetric metric) {
+    switch(metric) {
+        case MALLOC_TRANCER_METRIC_LIVE_COUNT:   return (size_t)(site->mallocCount - site->freeCount);
+        case MALLOC_TRANCER_METRIC_LIVE_BYTES:   return site->liveBytes;
+        case MALLOC_TRANCER_METRIC_MALLOC_COUNT: return (size_t)site->mallocCount;
+        case MALLOC_TRANCER_METRIC_MALLOC_BYTES: return site->mallocBytes;
+        default: return 0;
+    }
+}
+
+/**
+ * @brief min-heap sift down on the caller's out[] array, the smallest
+ *        candidate stays at out[0] so it is the one replaced next.
+ */
+STATIC void utils_site_heap_down(struct MallocTrancerSite * heap, int count, int i, enum MallocTrancerMetric metric) {
+    for(;;) {
+        int min = i, l = 2*i + 1, r = 2*i + 2;
+        if(l < count && utils_site_metric(&heap[l], metric) < utils_site_metric(&heap[min], metric)) min = l;
+        if(r < count && utils_site_metric(&heap[r], metric) < utils_site_metric(&heap[min], metric)) min = r;
+        if(min == i) return;
+        struct MallocTrancerSite t = heap[i]; heap[i] = heap[min]; heap[min] = t;
+        i = min;
+    }
+}
+
+STATIC void utils_site_heap_up(struct MallocTrancerSite * heap, int i, enum MallocTrancerMetric metric) {
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(utils_site_metric(&heap[parent], metric) <= utils_site_metric(&heap[i], metric)) return;
+        struct MallocTrancerSite t = heap[i]; heap[i] = heap[parent]; heap[parent] = t;
+        i = parent;
+    }
+}
+
+/**
+ * @brief select the N positions with the biggest metric, O(sites * logN)
+ * @param metric which counter to rank by
+ * @param n size of out[]
+ * @param out filled with the result, sorted from big to small
+ * @return how many entries are written to out[]
+ * @note no malloc inside, out[] is used as the heap storage.
+ */
+STATIC int topSites(struct MallocTrancer * tracer, enum MallocTrancerMetric metric, int n, struct MallocTrancerSite * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    if(n <= 0 || !out) return 0;
+
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct HashMap_Iterator iterator;
+    self->hashmapPositionAll->initIterator(self->hashmapPositionAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapPositionAll);
+        struct MallocTrancerInfo * info = (struct MallocTrancerInfo*)node->value;
+        struct MallocTrancerSite site;
+        utils_fill_site(&site, info);
+
+        if(count < n) {
+            out[count] = site;
+            utils_site_heap_up(out, count, metric);
+            count++;
+        }
+        else if(utils_site_metric(&site, metric) > utils_site_metric(&out[0], metric)) {
+            out[0] = site;
+            utils_site_heap_down(out, count, 0, metric);
+        }
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+
+    /* heap sort, pop the min to the tail, so out[] ends big to small */
+    for(int last = count - 1; last > 0; last--) {
+        struct MallocTrancerSite t = out[0]; out[0] = out[last]; out[last] = t;
+        utils_site_heap_down(out, last, 0, metric);
+    }
+    return count;
+}
+
+STATIC void utils_allocation_heap_down(struct MallocTrancerAllocation * heap, int count, int i) {
+    for(;;) {
+        int min = i, l = 2*i + 1, r = 2*i + 2;
+        if(l < count && heap[l].size < heap[min].size) min = l;
+        if(r < count && heap[r].size < heap[min].size) min = r;
+        if(min == i) return;
+        struct MallocTrancerAllocation t = heap[i]; heap[i] = heap[min]; heap[min] = t;
+        i = min;
+    }
+}
+
+STATIC void utils_allocation_heap_up(struct MallocTrancerAllocation * heap, int i) {
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(heap[parent].size <= heap[i].size) return;
+        struct MallocTrancerAllocation t = heap[i]; heap[i] = heap[parent]; heap[parent] = t;
+        i = parent;
+    }
+}
+
+/**
+ * @brief select the N biggest live blocks from the address table, O(blocks * logN)
+ * @param n size of out[]
+ * @param out filled with the result, sorted from big to small
+ * @return how many entries are written to out[]
+ */
+STATIC int topLiveAllocations(struct MallocTrancer * tracer, int n, struct MallocTrancerAllocation * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    if(n <= 0 || !out) return 0;
+
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct HashMap_Iterator iterator;
+    self->hashmapAddressAll->initIterator(self->hashmapAddressAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapAddressAll);
+        struct MallocTrancerAddressInfo * addressInfo = (struct MallocTrancerAddressInfo*)node->value;
+        struct MallocTrancerAllocation allocation;
+        utils_fill_allocation(self, &allocation, addressInfo);
+
+        if(count < n) {
+            out[count] = allocation;
+            utils_allocation_heap_up(out, count);
+            count++;
+        }
+        else if(allocation.size > out[0].size) {
+            out[0] = allocation;
+            utils_allocation_heap_down(out, count, 0);
+        }
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+
+    for(int last = count - 1; last > 0; last--) {
+        struct MallocTrancerAllocation t = out[0]; out[0] = out[last]; out[last] = t;
+        utils_allocation_heap_down(out, last, 0);
+    }
+    return count;
+}
+
+/* ===================== redzone ====================================*/
+
+#if MALLOC_TRANCER_ENABLE_REDZONE
+
+#if (MALLOC_TRANCER_REDZONE_SIZE % 8) != 0
+#error "MALLOC_TRANCER_REDZONE_SIZE must be a multiple of 8"
+#endif
+
+#define REDZONE_WORD ((uintptr_t)(~(uintptr_t)0 / 0xFF) * MALLOC_TRANCER_REDZONE_PATTERN)
+#define REDZONE_ALIGN(size) (((size) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1))
+#define REDZONE_TOTAL(size) (MALLOC_TRANCER_REDZONE_SIZE + REDZONE_ALIGN(size) + MALLOC_TRANCER_REDZONE_SIZE)
+
+
+/**
+ * @brief fill the guard bytes of a new block
+ * @param base the block returned by malloc, user data starts at base+MALLOC_TRANCER_REDZONE_SIZE
+ * @param size the size the user asked for
+ */
+STATIC void redzone_fill(uint8_t * base, size_t size) {
+    uintptr_t * front = (uintptr_t*)base;
+    uintptr_t * back = (uintptr_t*)(base + MALLOC_TRANCER_REDZONE_SIZE + REDZONE_ALIGN(size));
+    for(size_t i = 0; i < MALLOC_TRANCER_REDZONE_SIZE / sizeof(uintptr_t); i++) {
+        front[i] = REDZONE_WORD;
+        back[i] = REDZONE_WORD;
+    }
+    /* the bytes between the user end and the next word boundary are guard too */
+    memset(base + MALLOC_TRANCER_REDZONE_SIZE + size, MALLOC_TRANCER_REDZONE_PATTERN, REDZONE_ALIGN(size) - size);
+}
+
+/**
+ * @brief verify the guard bytes of a block, one word per compare
+ * @return true if both sides are intact
+ */
+STATIC bool redzone_verify(const uint8_t * base, size_t size) {
+    const uintptr_t * front = (const uintptr_t*)base;
+    const uintptr_t * back = (const uintptr_t*)(base + MALLOC_TRANCER_REDZONE_SIZE + REDZONE_ALIGN(size));
+    uintptr_t diff = 0;
+    for(size_t i = 0; i < MALLOC_TRANCER_REDZONE_SIZE / sizeof(uintptr_t); i++) {
+        diff |= (front[i] ^ REDZONE_WORD) | (back[i] ^ REDZONE_WORD);
+    }
+    for(size_t i = size; i < REDZONE_ALIGN(size); i++) {
+        diff |= base[MALLOC_TRANCER_REDZONE_SIZE + i] ^ MALLOC_TRANCER_REDZONE_PATTERN;
+    }
+    return diff == 0;
+}
+
+STATIC bool redzone_check(struct MallocTrancerInstance * self, struct MallocTrancerAddressInfo * addressInfo, const char * when) {
+    const uint8_t * base = (const uint8_t*)addressInfo->address - MALLOC_TRANCER_REDZONE_SIZE;
+    if(redzone_verify(base, addressInfo->size)) return true;
+
+    self->redzoneCorruptCount++;
+    addressInfo->info->corruptCount++;
+    MALLOC_TRANCER_LOG("\r\nMallocTracer: redzone corrupted (%s), address %#lX, size %lu, malloc at %s",
+            when, (unsigned long)addressInfo->address, (unsigned long)addressInfo->size, addressInfo->info->position);
+    return false;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_REDZONE */
+
+/**
+ * @brief verify the guard bytes of every live block
+ * @return how many corrupted blocks are found, always 0 if redzone is disabled
+ */
+STATIC int checkAll(struct MallocTrancer * tracer) {
+    (void)tracer;
+    int corrupted = 0;
+#if MALLOC_TRANCER_ENABLE_REDZONE
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct HashMap_Iterator iterator;
+    self->hashmapAddressAll->initIterator(self->hashmapAddressAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapAddressAll);
+        struct MallocTrancerAddressInfo * addressInfo = (struct MallocTrancerAddressInfo*)node->value;
+        /* a pool block is the pool's own, without guard bytes */
+        if(!addressInfo->pool && !redzone_check(self, addressInfo, "checkAll")) {
+            corrupted++;
+        }
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+#endif
+    return corrupted;
+}
+
+/* ===================== address index ==============================*/
+
+/* the memory a block really takes, including the redzone of a heap block */
+#if MALLOC_TRANCER_ENABLE_REDZONE
+#define BLOCK_BEGIN(addressInfo) ((addressInfo)->pool ? (addressInfo)->address : (addressInfo)->address - MALLOC_TRANCER_REDZONE_SIZE)
+#define BLOCK_END(addressInfo)   ((addressInfo)->pool ? (addressInfo)->address + (addressInfo)->size \
+        : (addressInfo)->address + REDZONE_ALIGN((addressInfo)->size) + MALLOC_TRANCER_REDZONE_SIZE)
+#else
+#define BLOCK_BEGIN(addressInfo) ((addressInfo)->address)
+#define BLOCK_END(addressInfo)   ((addressInfo)->address + (addressInfo)->size)
+#endif
+
+#if MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+
+/* AVL height is below 1.45*log2(n), 48 levels is far more than any heap */
+#define ADDRESS_INDEX_MAX_DEPTH 48
+
+STATIC int index_height(struct MallocTrancerAddressInfo * node) {
+    return node ? node->height : 0;
+}
+
+STATIC void index_update(struct MallocTrancerAddressInfo * node) {
+    int l = index_height(node->left), r = index_height(node->right);
+    node->height = (l > r ? l : r) + 1;
+}
+
+STATIC struct MallocTrancerAddressInfo * index_rotate_right(struct MallocTrancerAddressInfo * node) {
+    struct MallocTrancerAddressInfo * left = node->left;
+    node->left = left->right;
+    left->right = node;
+    index_update(node);
+    index_update(left);
+    return left;
+}
+
+STATIC struct MallocTrancerAddressInfo * index_rotate_left(struct MallocTrancerAddressInfo * node) {
+    struct MallocTrancerAddressInfo * right = node->right;
+    node->right = right->left;
+    right->left = node;
+    index_update(node);
+    index_update(right);
+    return right;
+}
+
+STATIC struct MallocTrancerAddressInfo * index_balance(struct MallocTrancerAddressInfo * node) {
+    index_update(node);
+    int balance = index_height(node->left) - index_height(node->right);
+    if(balance > 1) {
+        if(index_height(node->left->left) < index_height(node->left->right)) {
+            node->left = index_rotate_left(node->left);
+        }
+        return index_rotate_right(node);
+    }
+    if(balance < -1) {
+        if(index_height(node->right->right) < index_height(node->right->left)) {
+            node->right = index_rotate_right(node->right);
+        }
+        return index_rotate_left(node);
+    }
+    return node;
+}
+
+/**
+ * @brief insert a block to the index, and return the new root
+ * @note a block with the same address takes the place of the old one, the
+ *       same as hashmap_put does, the old entry is freed by the hash map.
+ */
+STATIC struct MallocTrancerAddressInfo * index_insert(struct MallocTrancerAddressInfo * root, struct MallocTrancerAddressInfo * node) {
+    if(!root) {
+        node->left = NULL;
+        node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+    if(node->address == root->address) {
+        node->left = root->left;
+        node->right = root->right;
+        node->height = root->height;
+        return node;
+    }
+    if(node->address < root->address) root->left = index_insert(root->left, node);
+    else root->right = index_insert(root->right, node);
+    return index_balance(root);
+}
+
+STATIC struct MallocTrancerAddressInfo * index_remove_min(struct MallocTrancerAddressInfo * root, struct MallocTrancerAddressInfo ** min) {
+    if(!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = index_remove_min(root->left, min);
+    return index_balance(root);
+}
+
+/**
+ * @brief remove a block from the index, and return the new root
+ */
+STATIC struct MallocTrancerAddressInfo * index_remove(struct MallocTrancerAddressInfo * root, struct MallocTrancerAddressInfo * node) {
+    if(!root) return NULL;
+    if(node->address < root->address) {
+        root->left = index_remove(root->left, node);
+    }
+    else if(node->address > root->address) {
+        root->right = index_remove(root->right, node);
+    }
+    else {
+        if(!root->left) return root->right;
+        if(!root->right) return root->left;
+        struct MallocTrancerAddressInfo * min;
+        struct MallocTrancerAddressInfo * right = index_remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = right;
+        root = min;
+    }
+    return index_balance(root);
+}
+
+STATIC void setHeapRange(struct MallocTrancer * tracer, uintptr_t start, uintptr_t end) {
+    INSTANCE(tracer)->heapStart = start;
+    INSTANCE(tracer)->heapEnd = end;
+}
+
+STATIC void utils_add_gap(struct MallocTrancerFragmentation * out, size_t gap) {
+    if(!gap) return;
+    int bucket = 0;
+    while((gap >> (bucket + 1)) && bucket < MALLOC_TRANCER_GAP_HISTOGRAM_LENGTH - 1) bucket++;
+    out->gapHistogram[bucket]++;
+    out->gapCount++;
+    out->freeBytes += gap;
+    if(gap > out->largestGap) out->largestGap = gap;
+}
+
+/**
+ * @brief walk the live blocks by address and measure the gaps between them
+ * @param out the result
+ * @return false if there is no heap range and no live block
+ * @note the gaps also include the allocator headers and the untraced blocks.
+ */
+STATIC bool getFragmentation(struct MallocTrancer * tracer, struct MallocTrancerFragmentation * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    memset(out, 0, sizeof(struct MallocTrancerFragmentation));
+    MALLOC_TRANCER_LOCK(&self->lock);
+    out->heapStart = self->heapStart;
+    out->heapEnd = self->heapEnd;
+    if(!self->heapStart && !self->heapEnd) {
+        if(!self->addressIndexRoot) {
+            MALLOC_TRANCER_UNLOCK(&self->lock);
+            return false;
+        }
+        struct MallocTrancerAddressInfo * node;
+        for(node = self->addressIndexRoot; node->left; node = node->left);
+        out->heapStart = BLOCK_BEGIN(node);
+        for(node = self->addressIndexRoot; node->right; node = node->right);
+        out->heapEnd = BLOCK_END(node);
+    }
+
+    /* in order walk without recursion */
+    struct MallocTrancerAddressInfo * stack[ADDRESS_INDEX_MAX_DEPTH];
+    int depth = 0;
+    uintptr_t cursor = out->heapStart;
+    struct MallocTrancerAddressInfo * node = self->addressIndexRoot;
+    while(node || depth) {
+        while(node) {
+            stack[depth++] = node;
+            node = node->left;
+        }
+        node = stack[--depth];
+
+        uintptr_t begin = BLOCK_BEGIN(node), end = BLOCK_END(node);
+        if(end > out->heapStart && begin < out->heapEnd) {
+            if(begin < out->heapStart) begin = out->heapStart;
+            if(end > out->heapEnd) end = out->heapEnd;
+            if(begin > cursor) utils_add_gap(out, begin - cursor);
+            if(end > cursor) {
+                out->usedBytes += end - (begin > cursor ? begin : cursor);
+                cursor = end;
+            }
+        }
+        node = node->right;
+    }
+    if(out->heapEnd > cursor) utils_add_gap(out, out->heapEnd - cursor);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+
+    if(out->freeBytes) {
+        out->fragmentationPermille = (int)(1000 - (uint64_t)out->largestGap * 1000 / out->freeBytes);
+    }
+    return true;
+}
+
+/**
+ * @brief find the live block which contains a address, O(logN)
+ * @param address any address, e.g. from a hard fault or a watchpoint
+ * @param out the block start, size and malloc position
+ * @return false if the address is not inside any live block
+ * @note a address in the redzone of a block also belongs to the block.
+ */
+STATIC bool findOwner(struct MallocTrancer * tracer, uintptr_t address, struct MallocTrancerAllocation * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    /* the last block which begins at or before the address */
+    struct MallocTrancerAddressInfo * floor = NULL;
+    bool found = false;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(struct MallocTrancerAddressInfo * node = self->addressIndexRoot; node;) {
+        if(BLOCK_BEGIN(node) <= address) {
+            floor = node;
+            node = node->right;
+        }
+        else {
+            node = node->left;
+        }
+    }
+    if(floor && (address < BLOCK_END(floor) || address == floor->address)) {
+        utils_fill_allocation(self, out, floor);
+        found = true;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return found;
+}
+
+#else
+
+/* no index, scan the whole address table */
+STATIC bool findOwner(struct MallocTrancer * tracer, uintptr_t address, struct MallocTrancerAllocation * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    bool found = false;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct HashMap_Iterator iterator;
+    self->hashmapAddressAll->initIterator(self->hashmapAddressAll, &iterator);
+    while(!found && iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapAddressAll);
+        struct MallocTrancerAddressInfo * addressInfo = (struct MallocTrancerAddressInfo*)node->value;
+        if((address >= BLOCK_BEGIN(addressInfo) && address < BLOCK_END(addressInfo)) || address == addressInfo->address) {
+            utils_fill_allocation(self, out, addressInfo);
+            found = true;
+        }
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return found;
+}
+
+STATIC void setHeapRange(struct MallocTrancer * tracer, uintptr_t start, uintptr_t end) {
+    (void)tracer;
+    (void)start;
+    (void)end;
+}
+
+STATIC bool getFragmentation(struct MallocTrancer * tracer, struct MallocTrancerFragmentation * out) {
+    (void)tracer;
+    memset(out, 0, sizeof(struct MallocTrancerFragmentation));
+    return false;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_ADDRESS_INDEX */
+
+/* ===================== owner ======================================*/
+
+/**
+ * @brief find the self->ownerTable index of a task/thread, O(1) for the
+ *        same owner as last time, else a short linear search.
+ * @note when the table is full, the new owners share the last slot (owner NULL).
+ */
+STATIC uint8_t owner_index(struct MallocTrancerInstance * self, void * owner) {
+    if(self->ownerCount && self->ownerTable[self->ownerLast].owner == owner) return (uint8_t)self->ownerLast;
+
+    for(int i = 0; i < self->ownerCount; i++) {
+        if(self->ownerTable[i].owner == owner) {
+            self->ownerLast = i;
+            return (uint8_t)i;
+        }
+    }
+    if(self->ownerCount < MALLOC_TRANCER_MAX_OWNERS - 1 || !self->ownerCount) {
+        self->ownerTable[self->ownerCount].owner = owner;
+        self->ownerLast = self->ownerCount++;
+        return (uint8_t)self->ownerLast;
+    }
+    /* full, the last slot is for all the others */
+    if(self->ownerCount == MALLOC_TRANCER_MAX_OWNERS - 1) {
+        self->ownerTable[self->ownerCount].owner = NULL;
+        self->ownerCount++;
+    }
+    return MALLOC_TRANCER_MAX_OWNERS - 1;
+}
+
+STATIC const char * owner_name(struct MallocTrancer * tracer, void * owner, char * buffer, size_t length) {
+    if(tracer->ownerName) {
+        const char * name = tracer->ownerName(owner);
+        if(name) return name;
+    }
+    snprintf(buffer, length, "%#lX", (unsigned long)(uintptr_t)owner);
+    return buffer;
+}
+
+/**
+ * @brief copy the per owner totals
+ * @param n size of out[]
+ * @return how many entries are written to out[]
+ */
+STATIC int getOwners(struct MallocTrancer * tracer, int n, struct MallocTrancerOwner * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(int i = 0; i < self->ownerCount && count < n; i++, count++) {
+        out[count].owner = self->ownerTable[i].owner;
+        out[count].mallocCount = self->ownerTable[i].mallocCount;
+        out[count].freeCount = self->ownerTable[i].freeCount;
+        out[count].liveBytes = self->ownerTable[i].liveBytes;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+/* ===================== epoch ======================================*/
+
+STATIC uint32_t mark(struct MallocTrancer * tracer) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    uint32_t epoch = self->currentEpoch + 1;
+    MALLOC_TRANCER_STORE_RELEASE(&self->currentEpoch, epoch);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return epoch;
+}
+
+/**
+ * @brief the live blocks malloc since a mark(), O(blocks), no malloc
+ * @param n size of out[], 0 to count only
+ * @return how many such blocks are live, could be more than n
+ */
+STATIC int liveSince(struct MallocTrancer * tracer, uint32_t epoch, int n, struct MallocTrancerAllocation * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct HashMap_Iterator iterator;
+    self->hashmapAddressAll->initIterator(self->hashmapAddressAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapAddressAll);
+        struct MallocTrancerAddressInfo * addressInfo = (struct MallocTrancerAddressInfo*)node->value;
+        if(addressInfo->epoch < epoch) continue;
+        if(out && count < n) utils_fill_allocation(self, &out[count], addressInfo);
+        count++;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+/* ===================== peak =======================================*/
+
+/**
+ * @brief copy on write of the peak: a new peak only bumps peakGeneration,
+ *        the first change of a position after it saves its value of before.
+ *        call it before the counters of the position change.
+ */
+STATIC void peak_touch(struct MallocTrancerInstance * self, struct MallocTrancerInfo * info) {
+    if(info->peakGeneration == self->peakGeneration) return;
+    info->peakGeneration = self->peakGeneration;
+    info->peakLiveCount = info->mallocCount - info->freeCount;
+    info->peakLiveBytes = info->mallocBytes - info->freeBytes;
+}
+
+/* after liveBytesAll grew, O(1) */
+STATIC void peak_check(struct MallocTrancerInstance * self) {
+    if(self->liveBytesAll <= self->peakBytes) return;
+    self->peakBytes = self->liveBytesAll;
+    self->peakGeneration++;
+    self->peakTime = (uint32_t)MALLOC_TRANCER_TIMESTAMP();
+}
+
+/**
+ * @brief the peak and the positions which held the most at it, O(sites * n), no malloc, under the lock
+ * @param n size of out[], a handful
+ * @return how many entries are written to out[]
+ */
+STATIC int peak_fill(struct MallocTrancerInstance * self, const struct MallocTrancerFilter * filter, struct MallocTrancerPeak * peak, int n, struct MallocTrancerPeakSite * out) {
+    int count = 0;
+    if(peak) {
+        peak->peakBytes = self->peakBytes;
+        peak->generation = self->peakGeneration;
+        peak->time = self->peakTime;
+    }
+    struct HashMap_Iterator iterator;
+    self->hashmapPositionAll->initIterator(self->hashmapPositionAll, &iterator);
+    while(out && n > 0 && iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapPositionAll);
+        struct MallocTrancerInfo * info = (struct MallocTrancerInfo*)node->value;
+        if(!filter_position(filter, info)) continue;
+        struct MallocTrancerPeakSite site;
+        site.position = info->position;
+        if(info->peakGeneration == self->peakGeneration) {
+            site.liveCount = info->peakLiveCount;
+            site.liveBytes = info->peakLiveBytes;
+        }
+        else {
+            /* not changed since the peak */
+            site.liveCount = info->mallocCount - info->freeCount;
+            site.liveBytes = info->mallocBytes - info->freeBytes;
+        }
+        if(!site.liveBytes) continue;
+
+        /* insertion into the sorted out[], the smallest falls off the end */
+        int i = count < n ? count++ : n;
+        while(i > 0 && out[i - 1].liveBytes < site.liveBytes) {
+            if(i < n) out[i] = out[i - 1];
+            i--;
+        }
+        if(i < n) out[i] = site;
+    }
+    return count;
+}
+
+STATIC int getPeak(struct MallocTrancer * tracer, struct MallocTrancerPeak * peak, int n, struct MallocTrancerPeakSite * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    int count = peak_fill(self, NULL, peak, n, out);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+STATIC void resetPeak(struct MallocTrancer * tracer) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    self->peakBytes = self->liveBytesAll;
+    self->peakGeneration++;
+    self->peakTime = (uint32_t)MALLOC_TRANCER_TIMESTAMP();
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+/* ===================== pool =======================================*/
+
+/**
+ * @brief register a fixed block pool, its blocks are traced by trace_pool_get/trace_pool_put
+ * @param name kept as is, not copied
+ * @return the pool id, -1 if MALLOC_TRANCER_MAX_POOLS pools are registered
+ */
+STATIC int addPool(struct MallocTrancer * tracer, const char * name, size_t blockSize, int capacity) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    int id = self->poolCount;
+    if(id < MALLOC_TRANCER_MAX_POOLS) {
+        struct MallocTrancerPool * pool = &self->poolTable[id].pool;
+        pool->name = name;
+        pool->blockSize = blockSize;
+        pool->capacity = capacity;
+        /* published last, the hot path checks the id against it without the lock */
+        MALLOC_TRANCER_STORE_RELEASE(&self->poolCount, id + 1);
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return id < MALLOC_TRANCER_MAX_POOLS ? id : -1;
+}
+
+/* O(1), the counters are indexed by the pool id */
+STATIC void pool_get(struct MallocTrancerInstance * self, int id, void * ptr) {
+    struct MallocTrancerPool * pool = &self->poolTable[id].pool;
+    if(!ptr) {
+        pool->failCount++;
+        return;
+    }
+    pool->getCount++;
+    pool->inUse++;
+    if(pool->inUse > pool->peakInUse) pool->peakInUse = pool->inUse;
+}
+
+STATIC void pool_put(struct MallocTrancerInstance * self, int id) {
+    struct MallocTrancerPool * pool = &self->poolTable[id].pool;
+    pool->putCount++;
+    if(pool->inUse) pool->inUse--;
+}
+
+/**
+ * @brief copy the per pool counters, in pool id order
+ * @param n size of out[]
+ * @return how many entries are written to out[]
+ */
+STATIC int getPools(struct MallocTrancer * tracer, int n, struct MallocTrancerPool * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(; count < self->poolCount && count < n; count++) {
+        out[count] = self->poolTable[count].pool;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+/**
+ * @brief close one rate period, getsPerSample is the gets since the last call
+ */
+STATIC void samplePools(struct MallocTrancer * tracer) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(int i = 0; i < self->poolCount; i++) {
+        struct MallocTrancerPoolInfo * info = &self->poolTable[i];
+        info->pool.getsPerSample = info->pool.getCount - info->sampleGetCount;
+        info->sampleGetCount = info->pool.getCount;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+/* ===================== snapshot ===================================*/
+
+
+/* the fields on the position text only, for the rows which are not of the live counts, e.g. PEAK and SLAB */
+STATIC bool filter_position(const struct MallocTrancerFilter * filter, const struct MallocTrancerInfo * info) {
+    if(!filter) return true;
+    if(filter->filePrefix && strncmp(info->position, filter->filePrefix, strlen(filter->filePrefix)) != 0) return false;
+    if(filter->func) {
+        /* the position is "file-line-func" */
+        const char * func = strrchr(info->position, '-');
+        if(!func || strcmp(func + 1, filter->func) != 0) return false;
+    }
+    return true;
+}
+
+STATIC bool filter_site(const struct MallocTrancerFilter * filter, const struct MallocTrancerInfo * info) {
+    if(!filter_position(filter, info)) return false;
+    if(info->mallocCount - info->freeCount < filter->minLiveCount) return false;
+    if(info->mallocBytes - info->freeBytes < filter->minLiveBytes) return false;
+    return true;
+}
+
+/* the position of the block must have passed filter_site() in this snapshot */
+STATIC bool filter_allocation(struct MallocTrancerInstance * self, const struct MallocTrancerFilter * filter, const struct MallocTrancerAddressInfo * addressInfo, uint32_t now) {
+    if(!addressInfo->info->filterMatch) return false;
+    if(filter->owner && self->ownerTable[addressInfo->owner].owner != filter->owner) return false;
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    if(filter->minAge && (uint32_t)(now - addressInfo->mallocTime) < filter->minAge) return false;
+#else
+    (void)now;
+#endif
+    return true;
+}
+
+STATIC struct MallocTrancerSnapshot * takeSnapshot(struct MallocTrancer * tracer) {
+    return takeFilteredSnapshot(tracer, NULL);
+}
+
+/**
+ * @brief copy the tables into a free snapshot buffer, only the rows matching filter
+ * @note the buffers only grow, and that is done outside the lock,
+ *       so the lock is only held for the flat copy, O(sites + blocks).
+ */
+STATIC struct MallocTrancerSnapshot * takeFilteredSnapshot(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    struct MallocTrancerSnapshotBuffer * buffer = NULL;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(int i = 0; i < 2; i++) {
+        if(!self->snapshotBuffer[i].busy) {
+            buffer = &self->snapshotBuffer[i];
+            buffer->busy = true;
+            break;
+        }
+    }
+    if(!buffer) {
+        MALLOC_TRANCER_UNLOCK(&self->lock);
+        return NULL;
+    }
+
+    while(buffer->siteCapacity < self->hashmapPositionAll->count || buffer->allocationCapacity < self->hashmapAddressAll->count) {
+        /* some headroom, the tables may grow before the lock is taken again */
+        size_t siteCapacity = self->hashmapPositionAll->count + self->hashmapPositionAll->count / 4 + 8;
+        size_t allocationCapacity = self->hashmapAddressAll->count + self->hashmapAddressAll->count / 4 + 8;
+        MALLOC_TRANCER_UNLOCK(&self->lock);
+        bool ok = true;
+        if(siteCapacity > buffer->siteCapacity) {
+            struct MallocTrancerSite * sites = realloc(buffer->snapshot.sites, siteCapacity * sizeof(struct MallocTrancerSite));
+            if(sites) {
+                buffer->snapshot.sites = sites;
+                buffer->siteCapacity = siteCapacity;
+            }
+            ok = sites != NULL;
+        }
+        if(ok && allocationCapacity > buffer->allocationCapacity) {
+            struct MallocTrancerAllocation * allocations = realloc(buffer->snapshot.allocations, allocationCapacity * sizeof(struct MallocTrancerAllocation));
+            if(allocations) {
+                buffer->snapshot.allocations = allocations;
+                buffer->allocationCapacity = allocationCapacity;
+            }
+            ok = allocations != NULL;
+        }
+        MALLOC_TRANCER_LOCK(&self->lock);
+        if(!ok) {
+            buffer->busy = false;
+            MALLOC_TRANCER_UNLOCK(&self->lock);
+            return NULL;
+        }
+    }
+
+    struct MallocTrancerSnapshot * snapshot = &buffer->snapshot;
+    struct HashMap_Iterator iterator;
+    snapshot->siteCount = 0;
+    self->hashmapPositionAll->initIterator(self->hashmapPositionAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapPositionAll);
+        struct MallocTrancerInfo * info = (struct MallocTrancerInfo*)node->value;
+        if(filter) {
+            info->filterMatch = filter_site(filter, info);
+            if(!info->filterMatch) continue;
+        }
+        utils_fill_site(&snapshot->sites[snapshot->siteCount++], info);
+    }
+    snapshot->allocationCount = 0;
+    uint32_t now = LIFETIME_NOW();
+    self->hashmapAddressAll->initIterator(self->hashmapAddressAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapAddressAll);
+        struct MallocTrancerAddressInfo * addressInfo = (struct MallocTrancerAddressInfo*)node->value;
+        if(filter && !filter_allocation(self, filter, addressInfo, now)) continue;
+        utils_fill_allocation(self, &snapshot->allocations[snapshot->allocationCount++], addressInfo);
+    }
+    snapshot->owners = buffer->owners;
+    snapshot->ownerCount = 0;
+    for(int i = 0; i < self->ownerCount; i++) {
+        if(filter && filter->owner && self->ownerTable[i].owner != filter->owner) continue;
+        struct MallocTrancerOwner * owner = &buffer->owners[snapshot->ownerCount++];
+        owner->owner = self->ownerTable[i].owner;
+        owner->mallocCount = self->ownerTable[i].mallocCount;
+        owner->freeCount = self->ownerTable[i].freeCount;
+        owner->liveBytes = self->ownerTable[i].liveBytes;
+    }
+    snapshot->pools = buffer->pools;
+    snapshot->poolCount = self->poolCount;
+    for(int i = 0; i < self->poolCount; i++) {
+        buffer->pools[i] = self->poolTable[i].pool;
+    }
+    snapshot->invalidFreeCount = self->invalidFreeCount;
+    snapshot->doubleFreeCount = self->doubleFreeCount;
+    utils_memory_usage(self, &snapshot->memory);
+    heap_stats(tracer, &snapshot->heap);
+    struct MallocTrancerPeak peak;
+    snapshot->peakSites = buffer->peakSites;
+    snapshot->peakSiteCount = peak_fill(self, filter, &peak, MALLOC_TRANCER_PEAK_REPORT_LENGTH, buffer->peakSites);
+    snapshot->peakBytes = peak.peakBytes;
+    snapshot->peakTime = peak.time;
+#if MALLOC_TRANCER_ENABLE_SLAB
+    snapshot->slabs = buffer->slabs;
+    snapshot->slabCount = slab_fill(self, filter, MALLOC_TRANCER_SLAB_MAX_SITES, buffer->slabs);
+#endif
+#if MALLOC_TRANCER_ENABLE_PROFILE
+    profile_fill(self, PROFILE_MALLOC, &snapshot->profile.malloc);
+    profile_fill(self, PROFILE_FREE, &snapshot->profile.free);
+#endif
+    snapshot->droppedEventCount = getDropCount(tracer);
+    snapshot->unmatchedFreeCount = self->unmatchedFreeCount;
+    snapshot->staleBlockCount = self->staleBlockCount;
+    snapshot->generation = ++self->snapshotGeneration;
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return snapshot;
+}
+
+STATIC void releaseSnapshot(struct MallocTrancer * tracer, struct MallocTrancerSnapshot * snapshot) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    if(!snapshot) return;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    ((struct MallocTrancerSnapshotBuffer*)snapshot)->busy = false;
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+/* ===================== pprof ======================================*/
+
+/* field numbers of profile.proto */
+#define PPROF_SAMPLE_TYPE   1
+#define PPROF_SAMPLE        2
+#define PPROF_LOCATION      4
+#define PPROF_FUNCTION      5
+#define PPROF_STRING_TABLE  6
+#define PPROF_PERIOD_TYPE   11
+#define PPROF_PERIOD        12
+#define PPROF_DEFAULT_SAMPLE_TYPE 14
+
+#define PB_VARINT 0
+#define PB_LENGTH 2
+
+/* the fixed strings, their index in string_table is the position here */
+STATIC const char * const pprofStrings[] = {
+    "", "inuse_objects", "count", "inuse_space", "bytes", "alloc_objects", "alloc_space", "space",
+};
+#define PPROF_STRING_COUNT ((int)(sizeof(pprofStrings) / sizeof(pprofStrings[0])))
+
+STATIC size_t pb_varint(uint8_t * out, uint64_t value) {
+    size_t n = 0;
+    while(value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+STATIC size_t pb_uint(uint8_t * out, int field, uint64_t value) {
+    size_t n = pb_varint(out, (uint64_t)field << 3 | PB_VARINT);
+    return n + pb_varint(out + n, value);
+}
+
+/**
+ * @brief a length delimited field, the header is written here and the data is passed through
+ */
+STATIC bool pb_bytes(MallocTrancerSink sink, void * context, int field, const void * data, size_t length) {
+    uint8_t header[16];
+    size_t n = pb_varint(header, (uint64_t)field << 3 | PB_LENGTH);
+    n += pb_varint(header + n, length);
+    return sink(header, n, context) && (!length || sink(data, length, context));
+}
+
+/* ValueType {type, unit} */
+STATIC bool pprof_value_type(MallocTrancerSink sink, void * context, int field, int type, int unit) {
+    uint8_t buffer[8];
+    size_t n = pb_uint(buffer, 1, type);
+    n += pb_uint(buffer + n, 2, unit);
+    return pb_bytes(sink, context, field, buffer, n);
+}
+
+/**
+ * @brief split "file-line-func" back, a C function name has no '-' so parse from the end
+ * @note "(other)" and truncated positions get the whole string as function and line 0
+ */
+STATIC void utils_split_position(const char * position, size_t * fileLength, long * line, const char ** func) {
+    const char * dash = strrchr(position, '-');
+    const char * lineStart = dash;
+    while(lineStart && lineStart > position && lineStart[-1] >= '0' && lineStart[-1] <= '9') lineStart--;
+    if(!dash || lineStart == dash || lineStart == position || lineStart[-1] != '-') {
+        *fileLength = 0;
+        *line = 0;
+        *func = position;
+        return;
+    }
+    *fileLength = (size_t)(lineStart - 1 - position);
+    *line = strtol(lineStart, NULL, 10);
+    *func = dash + 1;
+}
+
+/**
+ * @brief write a heap profile with the sample types inuse_objects, inuse_space,
+ *        alloc_objects and alloc_space, one Function/Location/Sample per position.
+ * @note protobuf repeated fields may interleave, so each position writes its
+ *       own strings, function, location and sample, nothing is buffered but one record.
+ *       The data comes from a snapshot, tracing goes on while writing.
+ */
+STATIC bool writePprof(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context) {
+    if(!sink) return false;
+    struct MallocTrancerSnapshot * snapshot = takeSnapshot(tracer);
+    if(!snapshot) return false;
+
+    bool ok = true;
+    for(int i = 0; ok && i < PPROF_STRING_COUNT; i++) {
+        ok = pb_bytes(sink, context, PPROF_STRING_TABLE, pprofStrings[i], strlen(pprofStrings[i]));
+    }
+    ok = ok && pprof_value_type(sink, context, PPROF_SAMPLE_TYPE, 1, 2)
+            && pprof_value_type(sink, context, PPROF_SAMPLE_TYPE, 3, 4)
+            && pprof_value_type(sink, context, PPROF_SAMPLE_TYPE, 5, 2)
+            && pprof_value_type(sink, context, PPROF_SAMPLE_TYPE, 6, 4)
+            && pprof_value_type(sink, context, PPROF_PERIOD_TYPE, 7, 4);
+    if(ok) {
+        uint8_t buffer[24];
+        size_t n = pb_uint(buffer, PPROF_PERIOD, 1);
+        n += pb_uint(buffer + n, PPROF_DEFAULT_SAMPLE_TYPE, 3);
+        ok = sink(buffer, n, context);
+    }
+
+    for(int i = 0; ok && i < snapshot->siteCount; i++) {
+        struct MallocTrancerSite * site = &snapshot->sites[i];
+        uint64_t id = (uint64_t)i + 1;
+        uint64_t funcString = PPROF_STRING_COUNT + 2 * (uint64_t)i;
+        size_t fileLength;
+        long line;
+        const char * func;
+        utils_split_position(site->position, &fileLength, &line, &func);
+        ok = pb_bytes(sink, context, PPROF_STRING_TABLE, func, strlen(func))
+            && pb_bytes(sink, context, PPROF_STRING_TABLE, site->position, fileLength);
+        if(!ok) break;
+
+        /* Function {id, name, system_name, filename} */
+        uint8_t buffer[64], lineBuffer[24], values[48];
+        size_t n = pb_uint(buffer, 1, id);
+        n += pb_uint(buffer + n, 2, funcString);
+        n += pb_uint(buffer + n, 3, funcString);
+        n += pb_uint(buffer + n, 4, funcString + 1);
+        ok = pb_bytes(sink, context, PPROF_FUNCTION, buffer, n);
+
+        /* Location {id, line {function_id, line}} */
+        size_t lineLength = pb_uint(lineBuffer, 1, id);
+        lineLength += pb_uint(lineBuffer + lineLength, 2, (uint64_t)line);
+        n = pb_uint(buffer, 1, id);
+        n += pb_varint(buffer + n, 4 << 3 | PB_LENGTH);
+        n += pb_varint(buffer + n, lineLength);
+        memcpy(buffer + n, lineBuffer, lineLength);
+        n += lineLength;
+        ok = ok && pb_bytes(sink, context, PPROF_LOCATION, buffer, n);
+
+        /* Sample {location_id, value packed} */
+        size_t valueLength = pb_varint(values, (uint64_t)(site->mallocCount - site->freeCount));
+        valueLength += pb_varint(values + valueLength, site->liveBytes);
+        valueLength += pb_varint(values + valueLength, (uint64_t)site->mallocCount);
+        valueLength += pb_varint(values + valueLength, site->mallocBytes);
+        n = pb_uint(buffer, 1, id);
+        n += pb_varint(buffer + n, 2 << 3 | PB_LENGTH);
+        n += pb_varint(buffer + n, valueLength);
+        memcpy(buffer + n, values, valueLength);
+        n += valueLength;
+        ok = ok && pb_bytes(sink, context, PPROF_SAMPLE, buffer, n);
+    }
+    releaseSnapshot(tracer, snapshot);
+    return ok;
+}
+
+/* ===================== JSON lines / CSV ===========================*/
+
+/* output of writeReport(), a small buffer passed to the sink each time it is full */
+struct ReportWriter {
+    struct MallocTrancer * tracer;
+    enum MallocTrancerFormat format;
+    bool header;      /* CSV: write the field names instead of the values */
+    MallocTrancerSink sink;
+    void * context;
+    bool ok;
+    size_t length;
+    char buffer[MALLOC_TRANCER_WRITER_BUFFER_SIZE];
+};
+
+STATIC void writer_flush(struct ReportWriter * writer) {
+    if(writer->ok && writer->length) writer->ok = writer->sink(writer->buffer, writer->length, writer->context);
+    writer->length = 0;
+}
+
+STATIC void writer_char(struct ReportWriter * writer, char c) {
+    if(writer->length == sizeof(writer->buffer)) writer_flush(writer);
+    writer->buffer[writer->length++] = c;
+}
+
+STATIC void writer_raw(struct ReportWriter * writer, const char * text) {
+    while(*text) writer_char(writer, *text++);
+}
+
+/* no printf, the digits come out backwards into a small buffer */
+STATIC void writer_digits(struct ReportWriter * writer, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while(value);
+    while(n) writer_char(writer, digits[--n]);
+}
+
+/**
+ * @brief a string value, JSON: quote, backslash and control characters escaped,
+ *        CSV: always quoted, a quote doubled. NULL is null / a empty field.
+ * @note other bytes go out as they are, positions come from __FILE__/__FUNCTION__
+ */
+STATIC void writer_quote(struct ReportWriter * writer, const char * text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    if(!text) {
+        if(writer->format == MALLOC_TRANCER_FORMAT_JSONL) writer_raw(writer, "null");
+        return;
+    }
+    writer_char(writer, '"');
+    for(size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if(writer->format == MALLOC_TRANCER_FORMAT_CSV) {
+            if(c == '"') writer_char(writer, '"');
+            writer_char(writer, (char)c);
+        }
+        else if(c == '"' || c == '\\') {
+            writer_char(writer, '\\');
+            writer_char(writer, (char)c);
+        }
+        else if(c == '\n') writer_raw(writer, "\\n");
+        else if(c == '\r') writer_raw(writer, "\\r");
+        else if(c == '\t') writer_raw(writer, "\\t");
+        else if(c < 0x20 || c == 0x7F) {
+            writer_raw(writer, "\\u00");
+            writer_char(writer, hex[c >> 4]);
+            writer_char(writer, hex[c & 0x0F]);
+        }
+        else writer_char(writer, (char)c);
+    }
+    writer_char(writer, '"');
+}
+
+STATIC void writer_begin(struct ReportWriter * writer, const char * type) {
+    if(writer->format == MALLOC_TRANCER_FORMAT_CSV) {
+        writer_raw(writer, writer->header ? "type" : type);
+        return;
+    }
+    writer_raw(writer, "{\"type\":\"");
+    writer_raw(writer, type);
+    writer_char(writer, '"');
+}
+
+/* return true if the value is to be written */
+STATIC bool writer_key(struct ReportWriter * writer, const char * key) {
+    if(writer->format == MALLOC_TRANCER_FORMAT_CSV) {
+        writer_char(writer, ',');
+        if(writer->header) writer_raw(writer, key);
+        return !writer->header;
+    }
+    writer_raw(writer, ",\"");
+    writer_raw(writer, key);
+    writer_raw(writer, "\":");
+    return true;
+}
+
+STATIC void writer_uint(struct ReportWriter * writer, const char * key, uint64_t value) {
+    if(writer_key(writer, key)) writer_digits(writer, value);
+}
+
+STATIC void writer_int(struct ReportWriter * writer, const char * key, int64_t value) {
+    if(!writer_key(writer, key)) return;
+    if(value < 0) writer_char(writer, '-');
+    writer_digits(writer, value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value);
+}
+
+STATIC void writer_string(struct ReportWriter * writer, const char * key, const char * text, size_t length) {
+    if(writer_key(writer, key)) writer_quote(writer, text, length);
+}
+
+STATIC void writer_end(struct ReportWriter * writer) {
+    writer_raw(writer, writer->format == MALLOC_TRANCER_FORMAT_CSV ? "\r\n" : "}\n");
+}
+
+/**
+ * @brief one record, CSV gets the header row before the first record of a kind
+ */
+STATIC void writer_record(struct ReportWriter * writer, void (*emit)(struct ReportWriter * writer, const void * row), const void * row, bool first) {
+    if(first && writer->format == MALLOC_TRANCER_FORMAT_CSV) {
+        writer->header = true;
+        emit(writer, row);
+        writer->header = false;
+    }
+    emit(writer, row);
+}
+
+STATIC void report_site(struct ReportWriter * writer, const void * row) {
+    const struct MallocTrancerSite * site = row;
+    size_t fileLength;
+    long line;
+    const char * func;
+    utils_split_position(site->position, &fileLength, &line, &func);
+    writer_begin(writer, "site");
+    writer_string(writer, "position", site->position, strlen(site->position));
+    writer_string(writer, "file", site->position, fileLength);
+    writer_int(writer, "line", line);
+    writer_string(writer, "func", func, strlen(func));
+    writer_int(writer, "malloc", site->mallocCount);
+    writer_int(writer, "free", site->freeCount);
+    writer_uint(writer, "liveBytes", site->liveBytes);
+    writer_uint(writer, "mallocBytes", site->mallocBytes);
+    writer_uint(writer, "lastAddress", site->lastAddress);
+    writer_int(writer, "invalidFree", site->invalidFreeCount);
+    writer_int(writer, "doubleFree", site->doubleFreeCount);
+    writer_end(writer);
+}
+
+STATIC void report_block(struct ReportWriter * writer, const void * row) {
+    const struct MallocTrancerAllocation * allocation = row;
+    writer_begin(writer, "block");
+    writer_uint(writer, "address", allocation->address);
+    writer_uint(writer, "size", allocation->size);
+    writer_string(writer, "position", allocation->position, strlen(allocation->position));
+    writer_uint(writer, "owner", (uintptr_t)allocation->owner);
+    writer_uint(writer, "epoch", allocation->epoch);
+    writer_end(writer);
+}
+
+STATIC void report_owner(struct ReportWriter * writer, const void * row) {
+    const struct MallocTrancerOwner * owner = row;
+    const char * name = writer->tracer->ownerName ? writer->tracer->ownerName(owner->owner) : NULL;
+    writer_begin(writer, "owner");
+    writer_uint(writer, "owner", (uintptr_t)owner->owner);
+    writer_string(writer, "name", name, name ? strlen(name) : 0);
+    writer_int(writer, "malloc", owner->mallocCount);
+    writer_int(writer, "free", owner->freeCount);
+    writer_uint(writer, "liveBytes", owner->liveBytes);
+    writer_end(writer);
+}
+
+STATIC void report_pool(struct ReportWriter * writer, const void * row) {
+    const struct MallocTrancerPool * pool = row;
+    writer_begin(writer, "pool");
+    writer_string(writer, "name", pool->name, strlen(pool->name));
+    writer_uint(writer, "blockSize", pool->blockSize);
+    writer_int(writer, "capacity", pool->capacity);
+    writer_int(writer, "inUse", pool->inUse);
+    writer_int(writer, "peakInUse", pool->peakInUse);
+    writer_uint(writer, "get", pool->getCount);
+    writer_uint(writer, "put", pool->putCount);
+    writer_uint(writer, "fail", pool->failCount);
+    writer_end(writer);
+}
+
+STATIC void report_summary(struct ReportWriter * writer, const void * row) {
+    const struct MallocTrancerSnapshot * snapshot = row;
+    const char * heap = INSTANCE(writer->tracer)->name;
+    writer_begin(writer, "summary");
+    writer_string(writer, "heap", heap, strlen(heap));
+    writer_uint(writer, "generation", snapshot->generation);
+    writer_int(writer, "sites", snapshot->siteCount);
+    writer_int(writer, "blocks", snapshot->allocationCount);
+    writer_int(writer, "invalidFree", snapshot->invalidFreeCount);
+    writer_int(writer, "doubleFree", snapshot->doubleFreeCount);
+    writer_uint(writer, "tracerBytes", snapshot->memory.totalBytes);
+    writer_uint(writer, "tracedBytes", snapshot->memory.tracedBytes);
+    writer_uint(writer, "droppedAddress", snapshot->memory.droppedAddressCount);
+    writer_uint(writer, "untrackedFree", snapshot->memory.untrackedFreeCount);
+    writer_uint(writer, "collapsedSite", snapshot->memory.collapsedSiteCount);
+    writer_uint(writer, "peakBytes", snapshot->peakBytes);
+    writer_uint(writer, "droppedEvents", snapshot->droppedEventCount);
+    writer_uint(writer, "unmatchedFree", snapshot->unmatchedFreeCount);
+    writer_uint(writer, "staleBlock", snapshot->staleBlockCount);
+    writer_uint(writer, "heapUsed", snapshot->heap.usedBytes);
+    writer_uint(writer, "heapTraced", snapshot->heap.tracedBytes);
+    writer_uint(writer, "heapOverhead", snapshot->heap.overheadBytes);
+    writer_uint(writer, "heapTracer", snapshot->heap.tracerBytes);
+    writer_int(writer, "heapUntraced", snapshot->heap.untracedBytes);
+    writer_int(writer, "untracedGrowth", snapshot->heap.untracedGrowth);
+    writer_end(writer);
+}
+
+/**
+ * @brief write a (filtered) snapshot record by record, for a ingestion pipeline.
+ *        nothing is truncated or padded, and there is no printf on the way,
+ *        only MALLOC_TRANCER_WRITER_BUFFER_SIZE bytes of stack.
+ */
+STATIC bool writeReport(struct MallocTrancer * tracer, enum MallocTrancerFormat format,
+        const struct MallocTrancerFilter * filter, MallocTrancerSink sink, void * context) {
+    if(!sink) return false;
+    struct MallocTrancerSnapshot * snapshot = takeFilteredSnapshot(tracer, filter);
+    if(!snapshot) return false;
+
+    struct ReportWriter writer;
+    writer.tracer = tracer;
+    writer.format = format;
+    writer.header = false;
+    writer.sink = sink;
+    writer.context = context;
+    writer.ok = true;
+    writer.length = 0;
+
+    writer_record(&writer, report_summary, snapshot, true);
+    for(int i = 0; writer.ok && i < snapshot->siteCount; i++) {
+        writer_record(&writer, report_site, &snapshot->sites[i], i == 0);
+    }
+    for(int i = 0; writer.ok && i < snapshot->allocationCount; i++) {
+        writer_record(&writer, report_block, &snapshot->allocations[i], i == 0);
+    }
+    for(int i = 0; writer.ok && i < snapshot->ownerCount; i++) {
+        writer_record(&writer, report_owner, &snapshot->owners[i], i == 0);
+    }
+    for(int i = 0; writer.ok && i < snapshot->poolCount; i++) {
+        writer_record(&writer, report_pool, &snapshot->pools[i], i == 0);
+    }
+    writer_flush(&writer);
+    releaseSnapshot(tracer, snapshot);
+    return writer.ok;
+}
+
+/* ===================== trend ======================================*/
+
+#if MALLOC_TRANCER_ENABLE_TREND
+
+#if MALLOC_TRANCER_TREND_LENGTH < 2 || MALLOC_TRANCER_TREND_LENGTH > 255
+#error "MALLOC_TRANCER_TREND_LENGTH must be 2..255"
+#endif
+
+/**
+ * @brief put a position in the sampled list on its malloc
+ */
+STATIC void trend_touch(struct MallocTrancerInstance * self, struct MallocTrancerInfo * info) {
+    if(info->trendActive) return;
+    info->trendActive = true;
+    info->trendNext = self->trendList;
+    self->trendList = info;
+}
+
+/**
+ * @brief push one period, the regression sums are kept up to date in O(1):
+ *        dropping the oldest (x = 0) shifts every other x down by one,
+ *        which takes sumY once from sumXY.
+ */
+STATIC void trend_push(struct MallocTrancerInfo * info) {
+    size_t bytes = info->mallocBytes - info->freeBytes;
+    if(info->trendCount == MALLOC_TRANCER_TREND_LENGTH) {
+        info->trendSumY -= (int64_t)info->trendBytesRing[info->trendHead];
+        info->trendSumXY -= info->trendSumY;
+    }
+    else {
+        info->trendCount++;
+    }
+    info->trendBytesRing[info->trendHead] = bytes;
+    info->trendCountRing[info->trendHead] = (uint32_t)(info->mallocCount - info->freeCount);
+    info->trendSumY += (int64_t)bytes;
+    info->trendSumXY += (int64_t)(info->trendCount - 1) * (int64_t)bytes;
+    info->trendHead = (uint8_t)((info->trendHead + 1) % MALLOC_TRANCER_TREND_LENGTH);
+}
+
+STATIC void sampleTrend(struct MallocTrancer * tracer) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct MallocTrancerInfo ** link = &self->trendList;
+    while(*link) {
+        struct MallocTrancerInfo * info = *link;
+        trend_push(info);
+        if(!info->trendSumY && info->trendCount == MALLOC_TRANCER_TREND_LENGTH) {
+            /* nothing live for a whole window, stop sampling until the next malloc */
+            info->trendActive = false;
+            info->trendCount = 0;
+            info->trendHead = 0;
+            info->trendSumXY = 0;
+            *link = info->trendNext;
+            continue;
+        }
+        link = &info->trendNext;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+/**
+ * @brief least squares slope of the window, over a full window only
+ * @return false if this position is not growing
+ */
+STATIC bool trend_leak(struct MallocTrancerInfo * info, struct MallocTrancerLeak * out) {
+    int64_t n = info->trendCount;
+    if(n < MALLOC_TRANCER_TREND_LENGTH) return false;
+    int64_t sumX = n * (n - 1) / 2;
+    int64_t sumXX = (n - 1) * n * (2 * n - 1) / 6;
+    int64_t numerator = n * info->trendSumXY - sumX * info->trendSumY;
+    int64_t denominator = n * sumXX - sumX * sumX;
+    int64_t growth = numerator * (n - 1) / denominator;
+    if(growth < MALLOC_TRANCER_TREND_MIN_GROWTH) return false;
+    /* sustained: the floor of the later half is above the floor of the earlier half,
+     * a position which goes up and down to the same level is not a leak */
+    size_t floor[2] = {SIZE_MAX, SIZE_MAX};
+    for(int i = 0; i < MALLOC_TRANCER_TREND_LENGTH; i++) {
+        size_t bytes = info->trendBytesRing[(info->trendHead + i) % MALLOC_TRANCER_TREND_LENGTH];
+        int half = i >= MALLOC_TRANCER_TREND_LENGTH / 2;
+        if(bytes < floor[half]) floor[half] = bytes;
+    }
+    if(floor[1] <= floor[0]) return false;
+
+    out->position = info->position;
+    out->liveCount = info->mallocCount - info->freeCount;
+    out->liveBytes = info->mallocBytes - info->freeBytes;
+    out->slopeBytes = (long)(numerator / denominator);
+    out->growthBytes = (long)growth;
+    out->samples = (int)n;
+    return true;
+}
+
+/**
+ * @param n size of out[]
+ * @return how many entries are written to out[], sorted by slope from big to small
+ */
+STATIC int suspectedLeaks(struct MallocTrancer * tracer, int n, struct MallocTrancerLeak * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    if(n <= 0 || !out) return 0;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(struct MallocTrancerInfo * info = self->trendList; info; info = info->trendNext) {
+        struct MallocTrancerLeak leak;
+        if(!trend_leak(info, &leak)) continue;
+        /* insert sorted, n is small */
+        int i = count < n ? count++ : n;
+        while(i > 0 && out[i - 1].growthBytes < leak.growthBytes) {
+            if(i < n) out[i] = out[i - 1];
+            i--;
+        }
+        if(i < n) out[i] = leak;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+#else
+
+#define trend_touch(self, info)
+
+STATIC void sampleTrend(struct MallocTrancer * tracer) {
+    (void)tracer;
+}
+
+STATIC int suspectedLeaks(struct MallocTrancer * tracer, int n, struct MallocTrancerLeak * out) {
+    (void)tracer;
+    (void)n;
+    (void)out;
+    return 0;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_TREND */
+
+/* ===================== event stream ===============================*/
+
+#if MALLOC_TRANCER_ENABLE_STREAM
+
+/**
+ * @brief hand one record to the sink, after a refused one a SYNC goes first
+ *        so the decoder restarts the deltas from 0
+ */
+STATIC bool stream_write(struct MallocTrancerInstance * self, const uint8_t * data, size_t length) {
+    if(self->streamSync) {
+        uint8_t sync[16];
+        size_t n = 0;
+        sync[n++] = MALLOC_TRANCER_STREAM_SYNC;
+        n += pb_varint(sync + n, MALLOC_TRANCER_STREAM_VERSION);
+        n += pb_varint(sync + n, self->streamDropCount);
+        if(!self->streamSink(sync, n, self->streamContext)) {
+            self->streamDropCount++;
+            return false;
+        }
+        self->streamSync = false;
+        self->streamTime = 0;
+        self->streamAddress = 0;
+        /* the deltas of this record are from the old base, the caller encodes again */
+        return false;
+    }
+    if(!self->streamSink(data, length, self->streamContext)) {
+        self->streamDropCount++;
+        self->streamSync = true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief time delta and address delta of a MALLOC/FREE, the base only moves when the record is sent
+ */
+STATIC size_t stream_encode(struct MallocTrancerInstance * self, uint8_t * out, uint8_t tag, struct MallocTrancerInfo * info, uintptr_t address, size_t size, uint32_t now) {
+    size_t n = 1;
+    intptr_t delta = (intptr_t)(address - self->streamAddress);
+    if(delta & ((1 << MALLOC_TRANCER_STREAM_ADDRESS_SHIFT) - 1)) tag |= MALLOC_TRANCER_STREAM_RAW_ADDRESS;
+    else delta >>= MALLOC_TRANCER_STREAM_ADDRESS_SHIFT;
+    n += pb_varint(out + n, (uint32_t)(now - self->streamTime));
+    if(info) {
+        uint32_t id = info->streamId - 1;
+        tag |= (uint8_t)((id < MALLOC_TRANCER_STREAM_SITE_INLINE_MAX ? id : MALLOC_TRANCER_STREAM_SITE_INLINE_MAX) << 3);
+        if(id >= MALLOC_TRANCER_STREAM_SITE_INLINE_MAX) n += pb_varint(out + n, id);
+        n += pb_varint(out + n, size);
+    }
+    n += pb_varint(out + n, ((uint64_t)(int64_t)delta << 1) ^ (uint64_t)((int64_t)delta >> 63));
+    out[0] = tag;
+    return n;
+}
+
+STATIC void stream_record(struct MallocTrancerInstance * self, uint8_t type, struct MallocTrancerInfo * info, uintptr_t address, size_t size) {
+    uint8_t record[48];
+    uint32_t now = (uint32_t)MALLOC_TRANCER_TIMESTAMP();
+    for(int retry = 0; retry < 2; retry++) {
+        size_t n = stream_encode(self, record, type, info, address, size, now);
+        if(stream_write(self, record, n)) {
+            self->streamTime = now;
+            self->streamAddress = address;
+            return;
+        }
+        /* only a sent SYNC is worth a second try */
+        if(self->streamSync) return;
+    }
+}
+
+STATIC void stream_malloc(struct MallocTrancerInstance * self, struct MallocTrancerInfo * info, uintptr_t address, size_t size) {
+    if(!self->streamSink) return;
+    if(!info->streamId) info->streamId = ++self->streamSiteCount;
+    if(!info->streamSent) {
+        uint8_t record[24];
+        size_t length = strlen(info->position);
+        size_t n = 0;
+        record[n++] = MALLOC_TRANCER_STREAM_SITE;
+        n += pb_varint(record + n, info->streamId - 1);
+        n += pb_varint(record + n, length);
+        /* a SITE has no delta, a SYNC sent in front of it needs no second encode */
+        if(!stream_write(self, record, n) && (self->streamSync || !stream_write(self, record, n))) return;
+        if(!self->streamSink(info->position, length, self->streamContext)) {
+            /* half a record, the decoder must resync */
+            self->streamDropCount++;
+            self->streamSync = true;
+            return;
+        }
+        info->streamSent = true;
+    }
+    stream_record(self, MALLOC_TRANCER_STREAM_MALLOC, info, address, size);
+}
+
+STATIC void stream_free(struct MallocTrancerInstance * self, uintptr_t address) {
+    if(!self->streamSink) return;
+    stream_record(self, MALLOC_TRANCER_STREAM_FREE, NULL, address, 0);
+}
+
+/**
+ * @brief start (or restart) the stream, the SITE records are sent again as the sites are used
+ */
+STATIC void setEventStream(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct HashMap_Iterator iterator;
+    self->hashmapPositionAll->initIterator(self->hashmapPositionAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapPositionAll);
+        ((struct MallocTrancerInfo*)node->value)->streamSent = false;
+    }
+    self->streamSink = sink;
+    self->streamContext = context;
+    self->streamSync = true;
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+STATIC unsigned long getStreamDropCount(struct MallocTrancer * tracer) {
+    return INSTANCE(tracer)->streamDropCount;
+}
+
+#else
+
+#define stream_malloc(self, info, address, size)
+#define stream_free(self, address)
+
+STATIC void setEventStream(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context) {
+    (void)tracer;
+    (void)sink;
+    (void)context;
+}
+
+STATIC unsigned long getStreamDropCount(struct MallocTrancer * tracer) {
+    (void)tracer;
+    return 0;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_STREAM */
+
+/* ===================== transport ==================================*/
+
+#if MALLOC_TRANCER_ENABLE_TRANSPORT
+
+/* staging ring, the bytes are sent in order from transportHead */
+STATIC uint8_t transportBuffer[MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE];
+STATIC size_t transportHead = 0;
+STATIC size_t transportCount = 0;
+STATIC struct MallocTrancerTransport * transport = NULL;
+
+/**
+ * @brief give the link as much of the staged bytes as it takes, never waits
+ * @return false if the link failed, the staged bytes are dropped then
+ */
+STATIC bool transport_flush(void) {
+    while(transportCount) {
+        size_t chunk = MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE - transportHead;
+        if(chunk > transportCount) chunk = transportCount;
+        int n = transport->write(transportBuffer + transportHead, chunk, transport->context);
+        if(n < 0) {
+            transport->droppedBytes += transportCount;
+            transportCount = 0;
+            transportHead = 0;
+            return false;
+        }
+        if(!n) return true;
+        transport->sentBytes += (unsigned long)n;
+        transportHead = (transportHead + (size_t)n) % MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE;
+        transportCount -= (size_t)n;
+    }
+    transportHead = 0;
+    return true;
+}
+
+/**
+ * @brief stage a record, then push what the link takes
+ * @param block wait for room, else a record which does not fit is dropped whole
+ */
+STATIC bool transport_put(const uint8_t * data, size_t length, bool block) {
+    transport_flush();
+    if(!block && length > MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE - transportCount) {
+        transport->droppedBytes += length;
+        transport->droppedRecords++;
+        return false;
+    }
+    while(length) {
+        size_t room = MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE - transportCount;
+        if(!room) {
+            if(!transport_flush()) break;
+            if(transportCount == MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE && transport->wait) transport->wait(transport->context);
+            continue;
+        }
+        size_t tail = (transportHead + transportCount) % MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE;
+        size_t chunk = MALLOC_TRANCER_TRANSPORT_BUFFER_SIZE - tail;
+        if(chunk > room) chunk = room;
+        if(chunk > length) chunk = length;
+        memcpy(transportBuffer + tail, data, chunk);
+        transportCount += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    if(length) {
+        transport->droppedBytes += length;
+        transport->droppedRecords++;
+        return false;
+    }
+    transport_flush();
+    return true;
+}
+
+/**
+ * @brief before the link is switched: push what is staged for the old one, waiting for it only
+ *        if its policy is MALLOC_TRANCER_POLICY_BLOCK, what is left is counted as dropped
+ */
+STATIC void transport_detach(void) {
+    while(transport && transportCount && transport_flush() && transportCount) {
+        if(transport->policy != MALLOC_TRANCER_POLICY_BLOCK) {
+            transport->droppedBytes += transportCount;
+            break;
+        }
+        if(transport->wait) transport->wait(transport->context);
+    }
+    transportHead = 0;
+    transportCount = 0;
+}
+
+STATIC bool transportSink(const void * data, size_t length, void * context) {
+    (void)context;
+    bool ok = false;
+    MALLOC_TRANCER_TRANSPORT_LOCK();
+    if(transport) ok = transport_put(data, length, transport->policy == MALLOC_TRANCER_POLICY_BLOCK);
+    MALLOC_TRANCER_TRANSPORT_UNLOCK();
+    return ok;
+}
+
+STATIC void setTransport(struct MallocTrancer * tracer, struct MallocTrancerTransport * link) {
+    (void)tracer;
+    MALLOC_TRANCER_TRANSPORT_LOCK();
+    transport_detach();
+    transport = link;
+    MALLOC_TRANCER_TRANSPORT_UNLOCK();
+}
+
+STATIC size_t flushTransport(struct MallocTrancer * tracer) {
+    (void)tracer;
+    MALLOC_TRANCER_TRANSPORT_LOCK();
+    if(transport) transport_flush();
+    size_t count = transportCount;
+    MALLOC_TRANCER_TRANSPORT_UNLOCK();
+    return count;
+}
+
+STATIC bool sendReport(struct MallocTrancer * tracer) {
+    return sendFilteredReport(tracer, NULL);
+}
+
+STATIC bool sendFilteredReport(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter) {
+    char * report = getFilteredInfo(tracer, filter);
+    if(!report) return false;
+    MALLOC_TRANCER_TRANSPORT_LOCK();
+    bool ok = transport && transport_put((const uint8_t*)report, strlen(report), true);
+    MALLOC_TRANCER_TRANSPORT_UNLOCK();
+    free(report);
+    return ok;
+}
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+STATIC struct MallocTrancerTransport fileTransport;
+
+STATIC int file_write(const void * data, size_t length, void * context) {
+    ssize_t n = write((int)(intptr_t)context, data, length);
+    if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    return (int)n;
+}
+
+STATIC void file_wait(void * context) {
+    (void)context;
+    usleep(1000);
+}
+
+/**
+ * @note a named pipe must have a reader already, else the open fails.
+ *       a file opened before is closed after transport_detach(), with MALLOC_TRANCER_POLICY_DROP
+ *       what it does not take at once is counted in droppedBytes, which goes on over the reopen.
+ */
+STATIC bool openFileTransport(struct MallocTrancer * tracer, const char * path, enum MallocTrancerPolicy policy) {
+    (void)tracer;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+    if(fd < 0) {
+        MALLOC_TRANCER_LOG("\r\nMallocTracer: open %s failed", path);
+        return false;
+    }
+    MALLOC_TRANCER_TRANSPORT_LOCK();
+    int oldFd = fileTransport.write ? (int)(intptr_t)fileTransport.context : -1;
+    transport_detach();
+    fileTransport.write = file_write;
+    fileTransport.wait = file_wait;
+    fileTransport.context = (void*)(intptr_t)fd;
+    fileTransport.policy = policy;
+    transport = &fileTransport;
+    MALLOC_TRANCER_TRANSPORT_UNLOCK();
+    if(oldFd >= 0) close(oldFd);
+    return true;
+}
+
+#else
+
+STATIC bool openFileTransport(struct MallocTrancer * tracer, const char * path, enum MallocTrancerPolicy policy) {
+    (void)tracer;
+    (void)path;
+    (void)policy;
+    return false;
+}
+
+#endif
+
+#else
+
+STATIC bool transportSink(const void * data, size_t length, void * context) {
+    (void)data;
+    (void)length;
+    (void)context;
+    return false;
+}
+
+STATIC void setTransport(struct MallocTrancer * tracer, struct MallocTrancerTransport * link) {
+    (void)tracer;
+    (void)link;
+}
+
+STATIC size_t flushTransport(struct MallocTrancer * tracer) {
+    (void)tracer;
+    return 0;
+}
+
+STATIC bool sendReport(struct MallocTrancer * tracer) {
+    (void)tracer;
+    return false;
+}
+
+STATIC bool sendFilteredReport(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter) {
+    (void)tracer;
+    (void)filter;
+    return false;
+}
+
+STATIC bool openFileTransport(struct MallocTrancer * tracer, const char * path, enum MallocTrancerPolicy policy) {
+    (void)tracer;
+    (void)path;
+    (void)policy;
+    return false;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_TRANSPORT */
+
+/* ===================== self accounting ============================*/
+
+STATIC size_t memory_used(struct MallocTrancerInstance * self) {
+    return sizeof(struct HashMap) * 2 + sizeof(struct Tree) * HASH_TABLE_MAX_LENGTH * 2
+        + (self->hashmapPositionAll->count + self->hashmapAddressAll->count) * sizeof(struct Tree_Node)
+        + self->hashmapPositionAll->keyBytes + self->hashmapAddressAll->keyBytes
+        + self->hashmapPositionAll->count * sizeof(struct MallocTrancerInfo)
+        + self->hashmapAddressAll->count * sizeof(struct MallocTrancerAddressInfo);
+}
+
+/**
+ * @brief could the tracer malloc this many bytes more for its tables
+ * @param soft true to stop at 3/4 of the budget
+ */
+STATIC bool memory_allow(struct MallocTrancerInstance * self, size_t bytes, bool soft) {
+    if(!self->memoryBudget) return true;
+    size_t limit = soft ? self->memoryBudget / 4 * 3 : self->memoryBudget;
+    return memory_used(self) + bytes <= limit;
+}
+
+#if (MALLOC_TRANCER_UNTRACKED_LENGTH & (MALLOC_TRANCER_UNTRACKED_LENGTH - 1)) != 0
+#error "MALLOC_TRANCER_UNTRACKED_LENGTH must be a power of 2"
+#endif
+
+#define UNTRACKED_MASK (MALLOC_TRANCER_UNTRACKED_LENGTH - 1)
+#define UNTRACKED_SLOT(address) ((size_t)((uint32_t)((address) >> 3) * 2654435761u) & UNTRACKED_MASK)
+
+/**
+ * @brief remember a block the budget does not store, O(1)
+ * @return false if the set is too full, the block must be stored then
+ */
+STATIC bool untracked_add(struct MallocTrancerInstance * self, uintptr_t address) {
+    if(self->untrackedLive >= MALLOC_TRANCER_UNTRACKED_LENGTH / 4 * 3) return false;
+    size_t i = UNTRACKED_SLOT(address);
+    while(self->untrackedSet[i]) i = (i + 1) & UNTRACKED_MASK;
+    self->untrackedSet[i] = address;
+    self->untrackedLive++;
+    return true;
+}
+
+/**
+ * @brief take a freed address out of the set, linear probing with backward shift, no tombstone
+ * @return false if it is not a block the budget dropped
+ */
+STATIC bool untracked_remove(struct MallocTrancerInstance * self, uintptr_t address) {
+    if(!self->untrackedLive) return false;
+    size_t i = UNTRACKED_SLOT(address);
+    while(self->untrackedSet[i] != address) {
+        if(!self->untrackedSet[i]) return false;
+        i = (i + 1) & UNTRACKED_MASK;
+    }
+    for(size_t j = (i + 1) & UNTRACKED_MASK; self->untrackedSet[j]; j = (j + 1) & UNTRACKED_MASK) {
+        /* an entry whose slot is cyclically in (i, j] is still reachable, the others move up to the hole */
+        size_t slot = UNTRACKED_SLOT(self->untrackedSet[j]);
+        if(i <= j ? (i < slot && slot <= j) : (i < slot || slot <= j)) continue;
+        self->untrackedSet[i] = self->untrackedSet[j];
+        i = j;
+    }
+    self->untrackedSet[i] = 0;
+    self->untrackedLive--;
+    self->untrackedFreeCount++;
+    /* its malloc was streamed before the budget dropped it */
+    stream_free(self, address);
+    return true;
+}
+
+STATIC void utils_memory_usage(struct MallocTrancerInstance * self, struct MallocTrancerMemory * out) {
+    out->siteBytes = self->hashmapPositionAll->count * sizeof(struct MallocTrancerInfo);
+    out->addressBytes = self->hashmapAddressAll->count * sizeof(struct MallocTrancerAddressInfo);
+    out->nodeBytes = (self->hashmapPositionAll->count + self->hashmapAddressAll->count) * sizeof(struct Tree_Node)
+        + sizeof(struct HashMap) * 2 + sizeof(struct Tree) * HASH_TABLE_MAX_LENGTH * 2;
+    out->keyBytes = self->hashmapPositionAll->keyBytes + self->hashmapAddressAll->keyBytes;
+    out->totalBytes = out->siteBytes + out->addressBytes + out->nodeBytes + out->keyBytes;
+    out->tracedBytes = self->liveBytesAll;
+    out->budget = self->memoryBudget;
+    out->droppedAddressCount = self->droppedAddressCount;
+    out->collapsedSiteCount = self->collapsedSiteCount;
+    out->untrackedFreeCount = self->untrackedFreeCount;
+}
+
+STATIC void getMemoryUsage(struct MallocTrancer * tracer, struct MallocTrancerMemory * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    utils_memory_usage(self, out);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+STATIC void setMemoryBudget(struct MallocTrancer * tracer, size_t bytes) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    self->memoryBudget = bytes;
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+/* ===================== heap reconciliation ========================*/
+
+#if MALLOC_TRANCER_HEAP_HISTORY < 2 || MALLOC_TRANCER_HEAP_HISTORY > 255
+#error "MALLOC_TRANCER_HEAP_HISTORY must be 2..255"
+#endif
+
+#if MALLOC_TRANCER_HEAP_STATS == MALLOC_TRANCER_HEAP_STATS_MALLINFO
+
+#include <malloc.h>
+
+/* the chunks in use in all the arenas, headers included, and the mmap'ed ones */
+STATIC size_t heap_used_default(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+#elif MALLOC_TRANCER_HEAP_STATS == MALLOC_TRANCER_HEAP_STATS_SBRK
+
+#include <unistd.h>
+
+#ifndef MALLOC_TRANCER_SBRK_BASE
+extern char end;   /* end of .bss, where _sbrk of the usual newlib syscalls starts the heap */
+#define MALLOC_TRANCER_SBRK_BASE ((uintptr_t)&end)
+#endif
+
+/* the break, the free chunks below it count as used, so the gap also shows the fragmentation */
+STATIC size_t heap_used_default(void) {
+    return (size_t)((uintptr_t)sbrk(0) - MALLOC_TRANCER_SBRK_BASE);
+}
+
+#elif MALLOC_TRANCER_HEAP_STATS == MALLOC_TRANCER_HEAP_STATS_FREERTOS
+
+#include "FreeRTOS.h"
+
+STATIC size_t heap_used_default(void) {
+    return configTOTAL_HEAP_SIZE - xPortGetFreeHeapSize();
+}
+
+#endif
+
+/* bytes the backend takes for a block of size bytes, by the MALLOC_TRANCER_HEAP_BLOCK_* model */
+STATIC size_t heap_chunk(size_t size) {
+    size_t chunk = (size + MALLOC_TRANCER_HEAP_BLOCK_HEADER + MALLOC_TRANCER_HEAP_BLOCK_ALIGN - 1)
+        / MALLOC_TRANCER_HEAP_BLOCK_ALIGN * MALLOC_TRANCER_HEAP_BLOCK_ALIGN;
+    return chunk < MALLOC_TRANCER_HEAP_BLOCK_MIN ? MALLOC_TRANCER_HEAP_BLOCK_MIN : chunk;
+}
+
+/* what a traced block costs the heap on top of its size, the redzones too */
+STATIC size_t heap_overhead(size_t size) {
+#if MALLOC_TRANCER_ENABLE_REDZONE
+    return heap_chunk(REDZONE_TOTAL(size)) - size;
+#else
+    return heap_chunk(size) - size;
+#endif
+}
+
+/* a hash map with a malloc'ed node, key copy and value per entry */
+STATIC size_t heap_table_bytes(const struct HashMap * hashmap, size_t valueSize) {
+    size_t bytes = heap_chunk(sizeof(struct HashMap)) + heap_chunk(sizeof(struct Tree) * HASH_TABLE_MAX_LENGTH);
+    if(hashmap->count) {
+        bytes += hashmap->count * (heap_chunk(sizeof(struct Tree_Node)) + heap_chunk(hashmap->keyBytes / hashmap->count) + heap_chunk(valueSize));
+    }
+    return bytes;
+}
+
+STATIC size_t heap_sub(size_t bytes, size_t minus) {
+    return minus < bytes ? bytes - minus : 0;
+}
+
+/**
+ * @brief split the bytes the backend reports in use, under the lock
+ * @note the blocks dropped by the memory budget are not in liveBytesAll, they count as untraced
+ */
+STATIC void heap_stats(struct MallocTrancer * tracer, struct MallocTrancerHeapStats * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    memset(out, 0, sizeof(struct MallocTrancerHeapStats));
+    if(!tracer->heapUsed) return;
+    out->usedBytes = tracer->heapUsed();
+    out->tracedBytes = self->liveBytesAll;
+    out->overheadBytes = self->liveOverheadBytes;
+
+    /* a pool block is in the pool's memory, not a heap block of its own */
+    for(int i = 0; i < self->poolCount; i++) {
+        const struct MallocTrancerPool * pool = &self->poolTable[i].pool;
+        out->tracedBytes = heap_sub(out->tracedBytes, (size_t)pool->inUse * pool->blockSize);
+        out->overheadBytes = heap_sub(out->overheadBytes, (size_t)pool->inUse * heap_overhead(pool->blockSize));
+    }
+#if MALLOC_TRANCER_ENABLE_SLAB
+    /* nor is a slab block, the slab is one block of the tracer, less the blocks in use */
+    for(int i = 0; i < self->slabCount; i++) {
+        const struct MallocTrancerSlabInfo * slab = &self->slabTable[i];
+        out->overheadBytes = heap_sub(out->overheadBytes, (size_t)slab->inUse * heap_overhead(slab->blockSize));
+        out->tracerBytes += heap_chunk(slab->blockSize * slab->blockCount) - (size_t)slab->inUse * slab->blockSize;
+    }
+#endif
+
+    /* the tables are malloc'ed, they are in this heap only if it is the malloc heap */
+    if(self->backendMalloc == malloc) {
+        out->tracerBytes += heap_table_bytes(self->hashmapPositionAll, sizeof(struct MallocTrancerInfo))
+            + heap_table_bytes(self->hashmapAddressAll, sizeof(struct MallocTrancerAddressInfo));
+        for(int i = 0; i < 2; i++) {
+            const struct MallocTrancerSnapshotBuffer * buffer = &self->snapshotBuffer[i];
+            if(buffer->siteCapacity) out->tracerBytes += heap_chunk(buffer->siteCapacity * sizeof(struct MallocTrancerSite));
+            if(buffer->allocationCapacity) out->tracerBytes += heap_chunk(buffer->allocationCapacity * sizeof(struct MallocTrancerAllocation));
+        }
+    }
+    out->untracedBytes = (long)out->usedBytes - (long)out->tracedBytes - (long)out->overheadBytes - (long)out->tracerBytes;
+
+    out->samples = self->heapHistoryCount;
+    if(out->samples) {
+        int oldest = (self->heapHistoryHead + MALLOC_TRANCER_HEAP_HISTORY - out->samples) % MALLOC_TRANCER_HEAP_HISTORY;
+        int newest = (self->heapHistoryHead + MALLOC_TRANCER_HEAP_HISTORY - 1) % MALLOC_TRANCER_HEAP_HISTORY;
+        out->untracedMin = out->untracedMax = self->heapHistory[oldest];
+        for(int i = 0; i < out->samples; i++) {
+            long untraced = self->heapHistory[(oldest + i) % MALLOC_TRANCER_HEAP_HISTORY];
+            if(untraced < out->untracedMin) out->untracedMin = untraced;
+            if(untraced > out->untracedMax) out->untracedMax = untraced;
+        }
+        out->untracedGrowth = self->heapHistory[newest] - self->heapHistory[oldest];
+    }
+}
+
+/**
+ * @brief add the untraced bytes of now to the window, O(pools + slabs)
+ * @note a steady untraced growth is a leak outside the tracer, a overhead
+ *       which follows the traced bytes is the allocator
+ */
+STATIC void sampleHeap(struct MallocTrancer * tracer) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    if(!tracer->heapUsed) return;
+    struct MallocTrancerHeapStats stats;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    heap_stats(tracer, &stats);
+    self->heapHistory[self->heapHistoryHead] = stats.untracedBytes;
+    self->heapHistoryHead = (uint8_t)((self->heapHistoryHead + 1) % MALLOC_TRANCER_HEAP_HISTORY);
+    if(self->heapHistoryCount < MALLOC_TRANCER_HEAP_HISTORY) self->heapHistoryCount++;
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+STATIC bool getHeapStats(struct MallocTrancer * tracer, struct MallocTrancerHeapStats * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    heap_stats(tracer, out);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return tracer->heapUsed != NULL;
+}
+
+/* ===================== shared memory ==============================*/
+
+#if MALLOC_TRANCER_ENABLE_SHM
+
+#if !defined(__linux__)
+#error "MALLOC_TRANCER_ENABLE_SHM is for linux host builds only"
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/**
+ * @brief copy the counters of a position to its slot, seqlock protocol:
+ *        the slot seq is odd while it is written, the reader retries on a odd
+ *        or changed seq, so the traced process never waits for the viewer.
+ */
+STATIC void shm_publish(struct MallocTrancerInstance * self, struct MallocTrancerInfo * info) {
+    if(!self->shmRegion) return;
+    if(!info->shmSlot) {
+        uint32_t count = self->shmRegion->siteCount;
+        if(count >= self->shmRegion->capacity) return;
+        info->shmSlot = count + 1;
+        strlcpy(self->shmRegion->sites[count].position, info->position, MALLOC_TRANCER_SHM_POSITION_LENGTH);
+        __atomic_store_n(&self->shmRegion->siteCount, count + 1, __ATOMIC_RELEASE);
+    }
+
+    struct MallocTrancerShmSite * site = &self->shmRegion->sites[info->shmSlot - 1];
+    uint32_t seq = site->seq;
+    __atomic_store_n(&site->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    site->mallocCount = info->mallocCount;
+    site->freeCount = info->freeCount;
+    site->mallocBytes = info->mallocBytes;
+    site->liveBytes = info->mallocBytes - info->freeBytes;
+    __atomic_store_n(&site->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->shmRegion->liveBytes, (uint64_t)self->liveBytesAll, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief create the shared memory region and publish the positions traced so far
+ * @param name shm_open name, NULL for MALLOC_TRANCER_SHM_NAME
+ */
+STATIC bool openShm(struct MallocTrancer * tracer, const char * name) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    if(INSTANCE(tracer)->shmRegion) return true;
+    size_t length = sizeof(struct MallocTrancerShm) + MALLOC_TRANCER_SHM_MAX_SITES * sizeof(struct MallocTrancerShmSite);
+    int fd = shm_open(name ? name : MALLOC_TRANCER_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if(fd < 0) return false;
+    if(ftruncate(fd, length) != 0) {
+        close(fd);
+        return false;
+    }
+    void * region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(region == MAP_FAILED) return false;
+
+    MALLOC_TRANCER_LOCK(&self->lock);
+    self->shmRegion = (struct MallocTrancerShm*)region;
+    memset(self->shmRegion, 0, length);
+    self->shmRegion->version = MALLOC_TRANCER_SHM_VERSION;
+    self->shmRegion->capacity = MALLOC_TRANCER_SHM_MAX_SITES;
+    self->shmRegion->pid = (uint32_t)getpid();
+
+    struct HashMap_Iterator iterator;
+    self->hashmapPositionAll->initIterator(self->hashmapPositionAll, &iterator);
+    while(iterator.hasNext(&iterator)){
+        struct Tree_Node * node = (struct Tree_Node*)iterator.next(&iterator, self->hashmapPositionAll);
+        struct MallocTrancerInfo * info = (struct MallocTrancerInfo*)node->value;
+        info->shmSlot = 0;
+        shm_publish(self, info);
+    }
+    /* the magic last, the viewer waits for it */
+    __atomic_store_n(&self->shmRegion->magic, MALLOC_TRANCER_SHM_MAGIC, __ATOMIC_RELEASE);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return true;
+}
+
+#else
+
+#define shm_publish(self, info)
+
+STATIC bool openShm(struct MallocTrancer * tracer, const char * name) {
+    (void)tracer;
+    (void)name;
+    return false;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_SHM */
+
+/* ===================== slab =======================================*/
+
+#if MALLOC_TRANCER_ENABLE_SLAB
+
+#define SLAB_ROUND_UP(size) (((size) + MALLOC_TRANCER_SLAB_ALIGN - 1) / MALLOC_TRANCER_SLAB_ALIGN * MALLOC_TRANCER_SLAB_ALIGN)
+/* a free block holds the free list link, so malloc(0) gets a block of at least a pointer too */
+#define SLAB_ROUND(size) SLAB_ROUND_UP((size) > sizeof(void*) ? (size) : sizeof(void*))
+
+/**
+ * @brief O(1) per malloc: count the position in the current window and vote for its size,
+ *        make its slab when both pass the thresholds
+ */
+STATIC void slab_consider(struct MallocTrancerInstance * self, struct MallocTrancerInfo * info, size_t size) {
+    if(++self->slabWindowMallocs >= MALLOC_TRANCER_SLAB_WINDOW) {
+        self->slabWindowMallocs = 0;
+        self->slabWindow++;
+    }
+    if(info->slab || info == &self->otherInfo) return;
+
+    if(info->slabWindow != self->slabWindow) {
+        info->slabWindow = self->slabWindow;
+        info->slabWindowMallocs = 0;
+    }
+    info->slabWindowMallocs++;
+    size = SLAB_ROUND(size);
+    if(info->slabCandidateSize == size) {
+        info->slabCandidateVotes++;
+    }
+    else if(!info->slabCandidateVotes) {
+        info->slabCandidateSize = size;
+        info->slabCandidateVotes = 1;
+    }
+    else {
+        info->slabCandidateVotes--;
+    }
+
+    if(info->slabWindowMallocs < MALLOC_TRANCER_SLAB_MIN_RATE || info->slabCandidateVotes < MALLOC_TRANCER_SLAB_MIN_RATE / 2) return;
+    if(info->slabCandidateSize > MALLOC_TRANCER_SLAB_MAX_BLOCK_SIZE || self->slabCount >= MALLOC_TRANCER_SLAB_MAX_SITES) return;
+
+    size_t blockSize = info->slabCandidateSize;
+    uint8_t * base = (uint8_t*)self->backendMalloc(blockSize * MALLOC_TRANCER_SLAB_BLOCKS);
+    if(!base) return;
+    struct MallocTrancerSlabInfo * slab = &self->slabTable[self->slabCount++];
+    slab->info = info;
+    slab->base = base;
+    slab->blockSize = blockSize;
+    slab->blockCount = MALLOC_TRANCER_SLAB_BLOCKS;
+    slab->freeList = NULL;
+    for(int i = MALLOC_TRANCER_SLAB_BLOCKS - 1; i >= 0; i--) {
+        *(void**)(base + i * blockSize) = slab->freeList;
+        slab->freeList = base + i * blockSize;
+    }
+    info->slab = (uint8_t)self->slabCount;
+}
+
+/**
+ * @brief a block of the position's slab, NULL if it has none, it is empty or the size does not fit
+ */
+STATIC void * slab_malloc(struct MallocTrancerInstance * self, struct MallocTrancerInfo * info, size_t size) {
+    if(!info->slab) return NULL;
+    struct MallocTrancerSlabInfo * slab = &self->slabTable[info->slab - 1];
+    if(!slab->freeList || SLAB_ROUND(size) != slab->blockSize) {
+        slab->missCount++;
+        return NULL;
+    }
+    void * block = slab->freeList;
+    slab->freeList = *(void**)block;
+    slab->inUse++;
+    slab->hitCount++;
+    return block;
+}
+
+/* the slab a address is in, NULL if none, at most MALLOC_TRANCER_SLAB_MAX_SITES compares */
+STATIC struct MallocTrancerSlabInfo * slab_find(struct MallocTrancerInstance * self, void * ptr) {
+    for(int i = 0; i < self->slabCount; i++) {
+        struct MallocTrancerSlabInfo * slab = &self->slabTable[i];
+        if((uint8_t*)ptr >= slab->base && (uint8_t*)ptr < slab->base + slab->blockSize * slab->blockCount) return slab;
+    }
+    return NULL;
+}
+
+/**
+ * @brief give a traced block back to its slab
+ * @return false if it is not from a slab, the backend must free it
+ */
+STATIC bool slab_free(struct MallocTrancerInstance * self, void * ptr) {
+    struct MallocTrancerSlabInfo * slab = slab_find(self, ptr);
+    if(!slab) return false;
+    *(void**)ptr = slab->freeList;
+    slab->freeList = ptr;
+    slab->inUse--;
+    return true;
+}
+
+/**
+ * @brief copy the slab counters, in creation order
+ * @param n size of out[]
+ * @return how many entries are written to out[]
+ */
+/* under the lock */
+STATIC int slab_fill(struct MallocTrancerInstance * self, const struct MallocTrancerFilter * filter, int n, struct MallocTrancerSlab * out) {
+    int count = 0;
+    for(int i = 0; i < self->slabCount && count < n; i++) {
+        struct MallocTrancerSlabInfo * slab = &self->slabTable[i];
+        if(!filter_position(filter, slab->info)) continue;
+        out[count].position = slab->info->position;
+        out[count].blockSize = slab->blockSize;
+        out[count].blockCount = slab->blockCount;
+        out[count].inUse = slab->inUse;
+        out[count].hitCount = slab->hitCount;
+        out[count].missCount = slab->missCount;
+        count++;
+    }
+    return count;
+}
+
+STATIC int getSlabs(struct MallocTrancer * tracer, int n, struct MallocTrancerSlab * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    int count = slab_fill(self, NULL, n, out);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+#else
+
+STATIC int getSlabs(struct MallocTrancer * tracer, int n, struct MallocTrancerSlab * out) {
+    (void)tracer;
+    (void)n;
+    (void)out;
+    return 0;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_SLAB */
+
+/* ===================== trace ======================================*/
+
+/**
+ * @brief find the record of a position, create it if this position not trace before
+ */
+STATIC struct MallocTrancerInfo * utils_get_position_info(struct MallocTrancerInstance * self, char * position) {
+    struct MallocTrancerInfo * _mallocTrancerInfo = (struct MallocTrancerInfo*)self->hashmapPositionAll->get(self->hashmapPositionAll, position);
+    if(!_mallocTrancerInfo) {
+        if(!memory_allow(self, sizeof(struct MallocTrancerInfo) + sizeof(struct Tree_Node) + strlen(position) + 1, false)) {
+            if(!self->hashmapPositionAll->get(self->hashmapPositionAll, self->otherInfo.position)) {
+                /* first use, one more node is allowed over the budget */
+                self->hashmapPositionAll->put(self->hashmapPositionAll, self->otherInfo.position, &self->otherInfo);
+            }
+            self->collapsedSiteCount++;
+            return &self->otherInfo;
+        }
+        _mallocTrancerInfo = malloc(sizeof(struct MallocTrancerInfo));
+        memset(_mallocTrancerInfo, 0, sizeof(struct MallocTrancerInfo));
+        strlcpy(_mallocTrancerInfo->position, position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
+        self->hashmapPositionAll->put(self->hashmapPositionAll, position, _mallocTrancerInfo);
+    }
+    return _mallocTrancerInfo;
+}
+
+/**
+ * @brief the key of a address in hashmapAddressAll, the same text as "%#lX" without a printf,
+ *        it is made on every malloc and free
+ */
+STATIC void utils_address_key(char * out, uintptr_t address) {
+    static const char digits[] = "0123456789ABCDEF";
+    char reverse[sizeof(uintptr_t) * 2];
+    int count = 0;
+    if(!address) {
+        strcpy(out, "0");
+        return;
+    }
+    while(address) {
+        reverse[count++] = digits[address & 0xF];
+        address >>= 4;
+    }
+    *out++ = '0';
+    *out++ = 'X';
+    while(count) *out++ = reverse[--count];
+    *out = '\0';
+}
+
+/**
+ * @brief count a block taken out of hashmapAddressAll as freed, at its position and owner
+ */
+STATIC void utils_release(struct MallocTrancerInstance * self, struct MallocTrancerAddressInfo * addressInfo) {
+#if MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+    self->addressIndexRoot = index_remove(self->addressIndexRoot, addressInfo);
+#endif
+    struct MallocTrancerInfo * _mallocTrancerInfo = addressInfo->info;
+    peak_touch(self, _mallocTrancerInfo);
+    _mallocTrancerInfo->freeCount++;
+    _mallocTrancerInfo->freeBytes += addressInfo->size;
+    self->liveBytesAll -= addressInfo->size;
+    self->liveOverheadBytes -= heap_overhead(addressInfo->size);
+    if(addressInfo->pool) self->livePoolBytes -= addressInfo->size;
+    /* the owner who malloc it, not the one who frees it */
+    self->ownerTable[addressInfo->owner].freeCount++;
+    self->ownerTable[addressInfo->owner].liveBytes -= addressInfo->size;
+}
+
+/**
+ * @brief add a new block to the tables
+ * @param owner the currentOwner() of the caller
+ * @param epoch the mark() epoch when it was malloc
+ */
+STATIC void record_malloc_info(struct MallocTrancerInstance * self, struct MallocTrancerInfo * _mallocTrancerInfo, void * ret, size_t size, uint8_t pool, void * owner, uint32_t epoch, uint32_t time) {
+    uintptr_t address = (uintptr_t)ret;
+    char addressStr[24] = "";
+    utils_address_key(addressStr, address);
+
+    /* still in the table: its free was lost (a dropped event, or a free past the tracer),
+     * take the stale block out so it does not stay live for ever */
+    struct MallocTrancerAddressInfo * stale = (struct MallocTrancerAddressInfo*)self->hashmapAddressAll->remove(self->hashmapAddressAll, addressStr);
+    if(stale) {
+        utils_release(self, stale);
+        shm_publish(self, stale->info);
+        self->staleBlockCount++;
+        free(stale);
+    }
+
+    /* @note: update in place, self->hashmapAddressAll keeps a pointer to this record */
+    peak_touch(self, _mallocTrancerInfo);
+    _mallocTrancerInfo->mallocCount++;
+    _mallocTrancerInfo->mallocBytes += size;
+    _mallocTrancerInfo->ptr_address = address;
+    shm_publish(self, _mallocTrancerInfo);
+    trend_touch(self, _mallocTrancerInfo);
+    stream_malloc(self, _mallocTrancerInfo, address, size);
+
+    /* out of budget: keep the blocks of the positions which have leaked before only */
+    size_t cost = sizeof(struct MallocTrancerAddressInfo) + sizeof(struct Tree_Node) + strlen(addressStr) + 1;
+    bool clean = _mallocTrancerInfo->mallocCount - 1 == _mallocTrancerInfo->freeCount + _mallocTrancerInfo->untrackedCount;
+    if(!memory_allow(self, cost, clean) && untracked_add(self, address)) {
+        _mallocTrancerInfo->untrackedCount++;
+        self->droppedAddressCount++;
+        return;
     }
 
+    self->liveBytesAll += size;
+    self->liveOverheadBytes += heap_overhead(size);
+    if(pool) self->livePoolBytes += size;
+    peak_check(self);
+    struct MallocTrancerAddressInfo * addressInfo = malloc(sizeof(struct MallocTrancerAddressInfo));
+    addressInfo->info = _mallocTrancerInfo;
+    addressInfo->address = address;
+    addressInfo->size = size;
+    addressInfo->owner = owner_index(self, owner);
+    addressInfo->pool = pool;
+    addressInfo->epoch = epoch;
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    addressInfo->mallocTime = time;
+#else
+    (void)time;
+#endif
+    self->ownerTable[addressInfo->owner].mallocCount++;
+    self->ownerTable[addressInfo->owner].liveBytes += size;
+#if MALLOC_TRANCER_ENABLE_ADDRESS_INDEX
+    self->addressIndexRoot = index_insert(self->addressIndexRoot, addressInfo);
+#endif
+    self->hashmapAddressAll->put(self->hashmapAddressAll, addressStr, addressInfo);
+}
+
+/**
+ * @brief the record of the position "file-line-func", created on first use
+ */
+STATIC struct MallocTrancerInfo * utils_position_info(struct MallocTrancerInstance * self, const char *file, const char *func,const long line) {
     char position[MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION] = "";
     snprintf(position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION, 
             "%s-%ld-%s", file, line, func);
+    return utils_get_position_info(self, position);
+}
 
-    struct MallocTrancerInfo * _mallocTrancerInfo = (struct MallocTrancerInfo*)hashmapPositionAll->get(hashmapPositionAll, position);
-    if(!_mallocTrancerInfo) {
-        /* this address not trace before */
-        struct MallocTrancerInfo * newMallocTrancerInfo = malloc(sizeof(struct MallocTrancerInfo));
-        strlcpy(newMallocTrancerInfo->position, position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
-        newMallocTrancerInfo->freeCount=0;
-        newMallocTrancerInfo->mallocCount = 1;
-        newMallocTrancerInfo->ptr_address = address;
-        hashmapPositionAll->put(hashmapPositionAll, position, newMallocTrancerInfo);
-    }
-    else if (_mallocTrancerInfo) {
-        struct MallocTrancerInfo * newMallocTrancerInfo = malloc(sizeof(struct MallocTrancerInfo));
-        strlcpy(newMallocTrancerInfo->position, position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
-        newMallocTrancerInfo->freeCount=_mallocTrancerInfo->freeCount;
-        newMallocTrancerInfo->mallocCount = _mallocTrancerInfo->mallocCount+1;
-        newMallocTrancerInfo->ptr_address = address;
-        /* @note: no need to free the old value, the hashmap will free it automaticlly */
-        hashmapPositionAll->put(hashmapPositionAll, position, newMallocTrancerInfo);
-    }
-
-    char * _p = (char*)malloc(MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
-    strlcpy(_p, position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
-    hashmapAddressAll->put(hashmapAddressAll, addressStr, _p);
+/**
+ * @brief the text of a position, copied from its record if the caller has one
+ */
+STATIC void utils_site_position(char * position, struct MallocTrancerInfo * site, const char *file, const char *func,const long line) {
+    if(site) {
+        strlcpy(position, site->position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
+        return;
+    }
+    snprintf(position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION, 
+            "%s-%ld-%s", file, line, func);
+}
 
-    return ret;
+/**
+ * @param site the position record from _trace_site(), NULL to look it up by file/func/line
+ */
+STATIC void record_malloc(struct MallocTrancerInstance * self, void * ret, size_t size, uint8_t pool, struct MallocTrancerInfo * site, const char *file, const char *func,const long line, void * owner, uint32_t epoch, uint32_t time) {
+    record_malloc_info(self, site ? site : utils_position_info(self, file, func, line), ret, size, pool, owner, epoch, time);
+}
+
+/**
+ * @brief a free of a address not in self->hashmapAddressAll, tell double free from
+ *        foreign pointer by the recent frees ring, and count it at the free position.
+ * @note call untracked_remove() first, a block dropped by the budget is not a bad free.
+ * @return true if the real free should be skipped, always for a double free with redzones
+ */
+STATIC bool utils_bad_free(struct MallocTrancerInstance * self, uintptr_t address, struct MallocTrancerInfo * site, const char *file, const char *func,const long line) {
+    struct MallocTrancerInfo * mallocInfo = NULL;
+    for(int i = 0; i < MALLOC_TRANCER_RECENT_FREE_LENGTH; i++) {
+        if(self->recentFree[i].address == address && self->recentFree[i].info) {
+            mallocInfo = self->recentFree[i].info;
+            break;
+        }
+    }
+    char position[MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION] = "";
+    utils_site_position(position, site, file, func, line);
+    struct MallocTrancerInfo * freeInfo = site ? site : utils_get_position_info(self, position);
 
+    if(mallocInfo) {
+        self->doubleFreeCount++;
+        freeInfo->doubleFreeCount++;
+        MALLOC_TRANCER_LOG("\r\nMallocTracer: double free of %#lX (malloc at %s), free at %s",
+                (unsigned long)address, mallocInfo->position, position);
+    }
+    else {
+        self->invalidFreeCount++;
+        freeInfo->invalidFreeCount++;
+        MALLOC_TRANCER_LOG("\r\nMallocTracer: free of unknown address %#lX, free at %s",
+                (unsigned long)address, position);
+    }
+#if MALLOC_TRANCER_ENABLE_REDZONE
+    /* the backend gave out address - MALLOC_TRANCER_REDZONE_SIZE and has it back already,
+     * any real free of it would only abort inside the backend, always block it */
+    if(mallocInfo) return true;
+#endif
+    return MALLOC_TRANCER_BLOCK_INVALID_FREE;
 }
 
-void _trace_free(void * ptr,const char *file, const char *func,const long line) {
-    free(ptr);
-    uint32_t address = (uint32_t)ptr;
-    char addressStr[16] = "";
-    snprintf(addressStr, sizeof(addressStr), "%#X", address);
-
-    char * position = (char*)hashmapAddressAll->get(hashmapAddressAll, addressStr);
-    if(!position) {
-        //log_w("free trance fial, address not malloc find before free");
+/**
+ * @brief take a block out of the tables and count the free
+ * @return the address entry, the caller frees it. NULL if the address is not traced
+ */
+STATIC struct MallocTrancerAddressInfo * record_free(struct MallocTrancerInstance * self, uintptr_t address, uint32_t time) {
+    char addressStr[24] = "";
+    utils_address_key(addressStr, address);
+
+    /* the only hash lookup of a free, the entry is taken out of the table at once */
+    struct MallocTrancerAddressInfo * addressInfo = (struct MallocTrancerAddressInfo*)self->hashmapAddressAll->remove(self->hashmapAddressAll, addressStr);
+    if(!addressInfo) return NULL;
+    /* only a block the tables know, a bad free would take a live block off the decoder's table */
+    stream_free(self, address);
+    utils_release(self, addressInfo);
+    struct MallocTrancerInfo * _mallocTrancerInfo = addressInfo->info;
+#if MALLOC_TRANCER_ENABLE_LIFETIME
+    /* O(1), a log2 bucket of the lifetime, the last one takes all the longer ones */
+    uint32_t lifetime = time - addressInfo->mallocTime;
+    int bucket = lifetime > 1 ? 31 - __builtin_clz(lifetime) : 0;
+    if(bucket > MALLOC_TRANCER_LIFETIME_BUCKETS - 1) bucket = MALLOC_TRANCER_LIFETIME_BUCKETS - 1;
+    _mallocTrancerInfo->lifetimeHistogram[bucket]++;
+#else
+    (void)time;
+#endif
+    shm_publish(self, _mallocTrancerInfo);
+
+    self->recentFree[self->recentFreeIndex].address = address;
+    self->recentFree[self->recentFreeIndex].info = _mallocTrancerInfo;
+    self->recentFreeIndex = (self->recentFreeIndex + 1) % MALLOC_TRANCER_RECENT_FREE_LENGTH;
+    return addressInfo;
+}
+
+/* ===================== deferred ===================================*/
+
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+
+#if (MALLOC_TRANCER_RING_LENGTH & (MALLOC_TRANCER_RING_LENGTH - 1)) != 0
+#error "MALLOC_TRANCER_RING_LENGTH must be a power of 2"
+#endif
+
+#if MALLOC_TRANCER_ENABLE_REDZONE || MALLOC_TRANCER_BLOCK_INVALID_FREE
+#error "redzone and invalid free blocking need the address table at free time, not available with MALLOC_TRANCER_ENABLE_DEFERRED"
+#endif
+
+#define EVENT_MALLOC 0
+#define EVENT_FREE   1
+
+#if MALLOC_TRANCER_RING_COUNT > 1
+STATIC uint32_t eventSeq = 0;
+#endif
+
+STATIC void deferred_push(struct MallocTrancerInstance * self, uint8_t type, uint8_t pool, void * ptr, size_t size, struct MallocTrancerInfo * site, const char *file, const char *func,const long line) {
+    /* no lock here, only the producer of this ring touches its head */
+    struct MallocTrancerRing * ring = &self->eventRing[MALLOC_TRANCER_CURRENT_RING()];
+    uint32_t head = ring->head;
+    if(head - MALLOC_TRANCER_LOAD_ACQUIRE(&ring->tail) >= MALLOC_TRANCER_RING_LENGTH) {
+        MALLOC_TRANCER_STORE_RELEASE(&ring->dropCount, ring->dropCount + 1);
         return;
     }
-    struct MallocTrancerInfo * _mallocTrancerInfo = (struct MallocTrancerInfo*)hashmapPositionAll->get(hashmapPositionAll, position);
-    if(!_mallocTrancerInfo) {
-        //log_w("free trance fial, position not malloc find before free");
+    struct MallocTrancerEvent * event = &ring->events[head & (MALLOC_TRANCER_RING_LENGTH - 1)];
+#if MALLOC_TRANCER_RING_COUNT > 1
+    event->seq = __atomic_fetch_add(&eventSeq, 1, __ATOMIC_RELAXED);
+#endif
+    event->type = type;
+    event->pool = pool;
+    event->ptr = ptr;
+    event->size = size;
+    event->site = site;
+    event->file = file;
+    event->func = func;
+    event->line = line;
+    event->owner = self->tracer.currentOwner ? self->tracer.currentOwner() : NULL;
+    /* stamped now, drain() may run after the next mark() */
+    event->epoch = MALLOC_TRANCER_LOAD_ACQUIRE(&self->currentEpoch);
+    event->time = LIFETIME_NOW();
+    /* the event must be visible before the new head */
+    MALLOC_TRANCER_STORE_RELEASE(&ring->head, head + 1);
+}
+
+STATIC void deferred_apply(struct MallocTrancerInstance * self, struct MallocTrancerEvent * event) {
+    if(event->type == EVENT_MALLOC) {
+        if(event->pool) pool_get(self, event->pool - 1, event->ptr);
+        /* a failed get has no block */
+        if(event->ptr) record_malloc(self, event->ptr, event->size, event->pool, event->site, event->file, event->func, event->line, event->owner, event->epoch, event->time);
+        return;
+    }
+    struct MallocTrancerAddressInfo * addressInfo = record_free(self, (uintptr_t)event->ptr, event->time);
+    if(addressInfo || untracked_remove(self, (uintptr_t)event->ptr)) {
+        /* only a put of a block the pool gave out counts */
+        if(event->pool) pool_put(self, event->pool - 1);
+    }
+    else if(getDropCount(&self->tracer)) {
+        /* its MALLOC may be one of the dropped events, the tables are incomplete */
+        self->unmatchedFreeCount++;
+    }
+    else {
+        utils_bad_free(self, (uintptr_t)event->ptr, event->site, event->file, event->func, event->line);
+    }
+    free(addressInfo);
+}
+
+/**
+ * @brief move all the pending events of the rings into the tables
+ * @return how many events are applied
+ * @note the rings are merged by the event sequence number, so a block
+ *       malloc in a task and freed in a interrupt is applied in order.
+ */
+STATIC int drain(struct MallocTrancer * tracer) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    int count = 0;
+    MALLOC_TRANCER_LOCK(&self->lock);
+    for(;;) {
+        struct MallocTrancerRing * next = NULL;
+        for(int i = 0; i < MALLOC_TRANCER_RING_COUNT; i++) {
+            struct MallocTrancerRing * ring = &self->eventRing[i];
+            /* read the event only after seeing the head */
+            if(MALLOC_TRANCER_LOAD_ACQUIRE(&ring->head) == ring->tail) continue;
+            if(!next || (int32_t)(ring->events[ring->tail & (MALLOC_TRANCER_RING_LENGTH - 1)].seq
+                    - next->events[next->tail & (MALLOC_TRANCER_RING_LENGTH - 1)].seq) < 0) {
+                next = ring;
+            }
+        }
+        if(!next) break;
+
+        uint32_t tail = next->tail;
+        deferred_apply(self, &next->events[tail & (MALLOC_TRANCER_RING_LENGTH - 1)]);
+        /* the slot could be reused only after it is read */
+        MALLOC_TRANCER_STORE_RELEASE(&next->tail, tail + 1);
+        count++;
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return count;
+}
+
+STATIC unsigned long getDropCount(struct MallocTrancer * tracer) {
+    unsigned long count = 0;
+    for(int i = 0; i < MALLOC_TRANCER_RING_COUNT; i++) {
+        count += MALLOC_TRANCER_LOAD_ACQUIRE(&INSTANCE(tracer)->eventRing[i].dropCount);
+    }
+    return count;
+}
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <unistd.h>
+
+STATIC unsigned int aggregatorPeriodMs;
+
+STATIC void * aggregator_thread(void * arg) {
+    (void)arg;
+    for(;;) {
+        /* instances are only ever added, at the end, so the list can be walked without the lock */
+        for(struct MallocTrancerInstance * self = instanceList; self; self = self->next) {
+            drain(&self->tracer);
+        }
+        usleep(aggregatorPeriodMs * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * @brief start a pthread which drains the rings every periodMs
+ */
+STATIC bool startAggregator(struct MallocTrancer * tracer, unsigned int periodMs) {
+    (void)tracer;
+    static pthread_t thread;
+    static bool started = false;
+    if(started) return true;
+    aggregatorPeriodMs = periodMs;
+    started = pthread_create(&thread, NULL, aggregator_thread, NULL) == 0;
+    return started;
+}
+#else
+/* no thread here, call drain() from a low priority task */
+STATIC bool startAggregator(struct MallocTrancer * tracer, unsigned int periodMs) {
+    (void)periodMs;
+    return false;
+}
+#endif
+
+#else
+
+STATIC int drain(struct MallocTrancer * tracer) {
+    (void)tracer;
+    return 0;
+}
+
+STATIC unsigned long getDropCount(struct MallocTrancer * tracer) {
+    (void)tracer;
+    return 0;
+}
+
+STATIC bool startAggregator(struct MallocTrancer * tracer, unsigned int periodMs) {
+    (void)tracer;
+    (void)periodMs;
+    return false;
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_DEFERRED */
+
+/* ===================== self profiling =============================*/
+
+#if MALLOC_TRANCER_ENABLE_PROFILE
+
+#if defined(__linux__) && !defined(__x86_64__) && !defined(__i386__)
+STATIC uint32_t utils_monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000000000u + now.tv_nsec);
+}
+#endif
+
+#define PROFILE_NOW() ((uint32_t)MALLOC_TRANCER_CYCLES())
+
+/* O(1): one bucket increment and a compare */
+STATIC void profile_add(struct MallocTrancerInstance * self, int op, uint32_t cycles) {
+    struct MallocTrancerProfileSlot * slot = &self->profile[PROFILE_SLOT()];
+    int bucket = cycles > 1 ? 31 - __builtin_clz(cycles) : 0;
+    slot->histogram[op][bucket]++;
+    if(cycles > slot->max[op]) slot->max[op] = cycles;
+}
+
+/* the upper bound of the bucket which holds the rank-th sample, not above max */
+STATIC uint32_t profile_percentile(const struct MallocTrancerLatency * latency, unsigned long rank) {
+    unsigned long seen = 0;
+    for(int i = 0; i < MALLOC_TRANCER_PROFILE_BUCKETS; i++) {
+        seen += latency->histogram[i];
+        if(seen < rank) continue;
+        uint32_t bound = i < 31 ? (2u << i) - 1 : 0xFFFFFFFFu;
+        return bound < latency->max ? bound : latency->max;
+    }
+    return latency->max;
+}
+
+STATIC void profile_fill(struct MallocTrancerInstance * self, int op, struct MallocTrancerLatency * out) {
+    memset(out, 0, sizeof(struct MallocTrancerLatency));
+    for(int s = 0; s < PROFILE_SLOT_COUNT; s++) {
+        struct MallocTrancerProfileSlot * slot = &self->profile[s];
+        for(int i = 0; i < MALLOC_TRANCER_PROFILE_BUCKETS; i++) {
+            out->histogram[i] += slot->histogram[op][i];
+            out->count += slot->histogram[op][i];
+        }
+        if(slot->max[op] > out->max) out->max = slot->max[op];
+    }
+    if(!out->count) return;
+    out->p50 = profile_percentile(out, (out->count + 1) / 2);
+    out->p99 = profile_percentile(out, out->count - out->count / 100);
+}
+
+/**
+ * @brief latency histograms of the tracer's work in trace_malloc/trace_free,
+ *        the backend malloc/free excluded, in MALLOC_TRANCER_CYCLES() units
+ */
+STATIC void getProfile(struct MallocTrancer * tracer, struct MallocTrancerProfile * out) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    MALLOC_TRANCER_LOCK(&self->lock);
+    profile_fill(self, PROFILE_MALLOC, &out->malloc);
+    profile_fill(self, PROFILE_FREE, &out->free);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+}
+
+#else
+
+#define PROFILE_NOW() 0
+
+STATIC void profile_add(struct MallocTrancerInstance * self, int op, uint32_t cycles) {
+    (void)self;
+    (void)op;
+    (void)cycles;
+}
+
+STATIC void getProfile(struct MallocTrancer * tracer, struct MallocTrancerProfile * out) {
+    (void)tracer;
+    memset(out, 0, sizeof(struct MallocTrancerProfile));
+}
+
+#endif /* MALLOC_TRANCER_ENABLE_PROFILE */
+
+/* ===================== entry ======================================*/
+
+/**
+ * @param site the position record from _trace_site(), NULL to look it up by file/func/line
+ */
+STATIC void * heap_malloc(struct MallocTrancerInstance * self, size_t size, struct MallocTrancerInfo * site, const char *file, const char *func,const long line) {
+#if MALLOC_TRANCER_ENABLE_SLAB
+    /* the position first, a hot one is served by its slab without the backend */
+    uint32_t start = PROFILE_NOW();
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct MallocTrancerInfo * info = site ? site : utils_position_info(self, file, func, line);
+    void * ret = slab_malloc(self, info, size);
+    if(!ret) {
+        uint32_t backendStart = PROFILE_NOW();
+        ret = self->backendMalloc(size);
+        start += PROFILE_NOW() - backendStart;
+    }
+    if(ret) {
+        record_malloc_info(self, info, ret, size, 0, self->tracer.currentOwner ? self->tracer.currentOwner() : NULL, self->currentEpoch, LIFETIME_NOW());
+        slab_consider(self, info, size);
+        profile_add(self, PROFILE_MALLOC, PROFILE_NOW() - start);
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return ret;
+#else
+#if MALLOC_TRANCER_ENABLE_REDZONE
+    uint8_t * base = (uint8_t*)self->backendMalloc(REDZONE_TOTAL(size));
+    void * ret = NULL;
+    if(base) {
+        redzone_fill(base, size);
+        ret = base + MALLOC_TRANCER_REDZONE_SIZE;
+    }
+#else
+    void * ret = self->backendMalloc(size);
+#endif
+    if(!ret) {
+        //log_w("malloc fail!");
+        return ret;
+    }
+
+    uint32_t start = PROFILE_NOW();
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+    deferred_push(self, EVENT_MALLOC, 0, ret, size, site, file, func, line);
+    profile_add(self, PROFILE_MALLOC, PROFILE_NOW() - start);
+#else
+    MALLOC_TRANCER_LOCK(&self->lock);
+    record_malloc(self, ret, size, 0, site, file, func, line, self->tracer.currentOwner ? self->tracer.currentOwner() : NULL, self->currentEpoch, LIFETIME_NOW());
+    /* the slot is written under the lock, the histogram is not atomic */
+    profile_add(self, PROFILE_MALLOC, PROFILE_NOW() - start);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+#endif
+    return ret;
+#endif /* MALLOC_TRANCER_ENABLE_SLAB */
+}
+
+/**
+ * @param site the position record from _trace_site(), only used to report a bad free
+ */
+STATIC void heap_free(struct MallocTrancerInstance * self, void * ptr, struct MallocTrancerInfo * site, const char *file, const char *func,const long line) {
+    if(!ptr) return;
+
+    uint32_t start = PROFILE_NOW();
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+    /* the event goes first, so a new malloc of the same address comes after it */
+    deferred_push(self, EVENT_FREE, 0, ptr, 0, site, file, func, line);
+    profile_add(self, PROFILE_FREE, PROFILE_NOW() - start);
+    self->backendFree(ptr);
+#else
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct MallocTrancerAddressInfo * addressInfo = record_free(self, (uintptr_t)ptr, LIFETIME_NOW());
+    if(!addressInfo) {
+        bool block = false;
+        void * base = ptr;
+        if(untracked_remove(self, (uintptr_t)ptr)) {
+#if MALLOC_TRANCER_ENABLE_REDZONE
+            /* dropped by the budget, its size is not known so the guard bytes are not checked */
+            base = (uint8_t*)ptr - MALLOC_TRANCER_REDZONE_SIZE;
+#elif MALLOC_TRANCER_ENABLE_SLAB
+            /* a slab block goes back to its slab, not to the backend */
+            block = slab_free(self, ptr);
+#endif
+        }
+        else {
+            block = utils_bad_free(self, (uintptr_t)ptr, site, file, func, line);
+#if MALLOC_TRANCER_ENABLE_SLAB
+            /* unknown to the tables, a slab block is never put back, it could be a double free */
+            if(slab_find(self, ptr)) block = true;
+#endif
+        }
+        profile_add(self, PROFILE_FREE, PROFILE_NOW() - start);
+        MALLOC_TRANCER_UNLOCK(&self->lock);
+        if(!block) {
+            self->backendFree(base);
+        }
         return;
     }
-    struct MallocTrancerInfo * newMallocTrancerInfo = malloc(sizeof(struct MallocTrancerInfo));
-    strlcpy(newMallocTrancerInfo->position, position, MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION);
-    newMallocTrancerInfo->freeCount=_mallocTrancerInfo->freeCount+1;
-    newMallocTrancerInfo->mallocCount = _mallocTrancerInfo->mallocCount;
-    newMallocTrancerInfo->ptr_address = address;
-    /* @note: no need to free the old value, the hashmap will free it automaticlly */
-    hashmapPositionAll->put(hashmapPositionAll, position, newMallocTrancerInfo);
- 
-    hashmapAddressAll->delete(hashmapAddressAll, addressStr);
+#if MALLOC_TRANCER_ENABLE_REDZONE
+    if(!redzone_check(self, addressInfo, "free")) {
+        char position[MALLOC_TRANCER_STRING_LENGTH_INFO_POSITION] = "";
+        utils_site_position(position, site, file, func, line);
+        MALLOC_TRANCER_LOG(", free at %s", position);
+    }
+    uint32_t backendStart = PROFILE_NOW();
+    self->backendFree((uint8_t*)ptr - MALLOC_TRANCER_REDZONE_SIZE);
+#elif MALLOC_TRANCER_ENABLE_SLAB
+    uint32_t backendStart = PROFILE_NOW();
+    if(!slab_free(self, ptr)) self->backendFree(ptr);
+#else
+    uint32_t backendStart = PROFILE_NOW();
+    self->backendFree(ptr);
+#endif
+    /* the backend free is not the tracer's time */
+    start += PROFILE_NOW() - backendStart;
+    free(addressInfo);
+    profile_add(self, PROFILE_FREE, PROFILE_NOW() - start);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+#endif
     return;
-}
\ No newline at end of file
+}
+
+void * _trace_heap_malloc(struct MallocTrancer * tracer, size_t size,  const char *file, const char *func,const long line) {
+    return heap_malloc(INSTANCE(tracer), size, NULL, file, func, line);
+}
+
+void _trace_heap_free(struct MallocTrancer * tracer, void * ptr,const char *file, const char *func,const long line) {
+    heap_free(INSTANCE(tracer), ptr, NULL, file, func, line);
+}
+
+/**
+ * @brief trace a block got from pool `id`, pass the result of the pool's own get,
+ *        NULL counts as a failed get
+ * @return ptr
+ */
+void * _trace_pool_get(struct MallocTrancer * tracer, int id, void * ptr, const char *file, const char *func,const long line) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    if(id < 0 || id >= MALLOC_TRANCER_LOAD_ACQUIRE(&self->poolCount)) return ptr;
+
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+    deferred_push(self, EVENT_MALLOC, (uint8_t)(id + 1), ptr, self->poolTable[id].pool.blockSize, NULL, file, func, line);
+#else
+    MALLOC_TRANCER_LOCK(&self->lock);
+    pool_get(self, id, ptr);
+    if(ptr) {
+        record_malloc(self, ptr, self->poolTable[id].pool.blockSize, (uint8_t)(id + 1), NULL, file, func, line,
+                tracer->currentOwner ? tracer->currentOwner() : NULL, self->currentEpoch, LIFETIME_NOW());
+    }
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+#endif
+    return ptr;
+}
+
+/**
+ * @brief trace a block given back to pool `id`, call it before the pool's own put
+ */
+void _trace_pool_put(struct MallocTrancer * tracer, int id, void * ptr, const char *file, const char *func,const long line) {
+    struct MallocTrancerInstance * self = INSTANCE(tracer);
+    if(!ptr || id < 0 || id >= MALLOC_TRANCER_LOAD_ACQUIRE(&self->poolCount)) return;
+
+#if MALLOC_TRANCER_ENABLE_DEFERRED
+    deferred_push(self, EVENT_FREE, (uint8_t)(id + 1), ptr, 0, NULL, file, func, line);
+#else
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct MallocTrancerAddressInfo * addressInfo = record_free(self, (uintptr_t)ptr, LIFETIME_NOW());
+    /* the block is the pool's, only reported, never passed to a free */
+    if(addressInfo || untracked_remove(self, (uintptr_t)ptr)) pool_put(self, id);
+    else utils_bad_free(self, (uintptr_t)ptr, NULL, file, func, line);
+    free(addressInfo);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+#endif
+}
+
+void * _trace_malloc(size_t size,  const char *file, const char *func,const long line) {
+    return heap_malloc(&defaultInstance, size, NULL, file, func, line);
+}
+
+void _trace_free(void * ptr,const char *file, const char *func,const long line) {
+    heap_free(&defaultInstance, ptr, NULL, file, func, line);
+}
+
+/**
+ * @brief the position record of "file-line-func" on the default heap, created on first use.
+ *        keep it, e.g. in a static, the position text is then formatted only once
+ */
+struct MallocTrancerInfo * _trace_site(const char *file, const char *func,const long line) {
+    struct MallocTrancerInstance * self = INSTANCE(New_MallocTrancer());
+    MALLOC_TRANCER_LOCK(&self->lock);
+    struct MallocTrancerInfo * site = utils_position_info(self, file, func, line);
+    MALLOC_TRANCER_UNLOCK(&self->lock);
+    return site;
+}
+
+void * _trace_malloc_site(size_t size, struct MallocTrancerInfo * site) {
+    return heap_malloc(&defaultInstance, size, site, NULL, NULL, 0);
+}
+
+void _trace_free_site(void * ptr, struct MallocTrancerInfo * site) {
+    heap_free(&defaultInstance, ptr, site, NULL, NULL, 0);
+}
@@ -1,15 +1,407 @@
 #ifndef __MALLOC_TRANCER__
 #define __MALLOC_TRANCER__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define trace_malloc(size) _trace_malloc(size, __FILE__, __FUNCTION__, __LINE__)
 #define trace_free(ptr) _trace_free(ptr, __FILE__, __FUNCTION__, __LINE__)
+/* on a heap from New_MallocTrancerHeap() */
+#define trace_heap_malloc(tracer, size) _trace_heap_malloc(tracer, size, __FILE__, __FUNCTION__, __LINE__)
+#define trace_heap_free(tracer, ptr) _trace_heap_free(tracer, ptr, __FILE__, __FUNCTION__, __LINE__)
+/* around the get/put of a fixed block pool from addPool(), e.g. p = trace_pool_get(tracer, rxPool, osPoolAlloc(rx)) */
+#define trace_pool_get(tracer, id, ptr) _trace_pool_get(tracer, id, ptr, __FILE__, __FUNCTION__, __LINE__)
+#define trace_pool_put(tracer, id, ptr) _trace_pool_put(tracer, id, ptr, __FILE__, __FUNCTION__, __LINE__)
+
+/* where the streamed output goes, return false to stop */
+typedef bool (*MallocTrancerSink)(const void * data, size_t length, void * context);
+
+/* what the transport does with a record that does not fit its staging buffer */
+enum MallocTrancerPolicy {
+   MALLOC_TRANCER_POLICY_DROP,     /* drop the record and count it, never wait */
+   MALLOC_TRANCER_POLICY_BLOCK,    /* wait until the link takes enough bytes */
+};
+
+/* a output link (UART, RTT, file, pipe...), set by setTransport() */
+struct MallocTrancerTransport {
+   /* non-blocking: take up to length bytes, return how many were taken, 0 if busy, < 0 on error */
+   int (*write)(const void * data, size_t length, void * context);
+   /* MALLOC_TRANCER_POLICY_BLOCK: called while the link is busy, e.g. vTaskDelay(1), NULL to spin */
+   void (*wait)(void * context);
+   void * context;
+   enum MallocTrancerPolicy policy;
+   /* counted by the tracer */
+   unsigned long sentBytes;
+   unsigned long droppedBytes;
+   unsigned long droppedRecords;
+};
+
+/* which counter topSites() rank the positions by */
+enum MallocTrancerMetric {
+   MALLOC_TRANCER_METRIC_LIVE_COUNT,
+   MALLOC_TRANCER_METRIC_LIVE_BYTES,
+   MALLOC_TRANCER_METRIC_MALLOC_COUNT,
+   MALLOC_TRANCER_METRIC_MALLOC_BYTES,
+};
+
+/* the record formats of writeReport() */
+enum MallocTrancerFormat {
+   MALLOC_TRANCER_FORMAT_JSONL,    /* one JSON object per line, "type" tells the record */
+   MALLOC_TRANCER_FORMAT_CSV,      /* the first column tells the record, a "type,..." header row before the first of each */
+};
+
+#define MALLOC_TRANCER_LIFETIME_BUCKETS 16
+
+/* one row of the POSITION table, copied out by topSites() */
+struct MallocTrancerSite {
+   const char * position;
+   int mallocCount;
+   int freeCount;
+   size_t liveBytes;
+   size_t mallocBytes;
+   uintptr_t lastAddress;   /* the last block malloc here */
+   int invalidFreeCount;
+   int doubleFreeCount;
+   /* MALLOC_TRANCER_ENABLE_LIFETIME: lifetimeHistogram[i] counts the freed blocks which lived
+    * [2^i, 2^(i+1)) clock ticks, [0] also counts 0, the last one counts all longer */
+   uint32_t lifetimeHistogram[MALLOC_TRANCER_LIFETIME_BUCKETS];
+};
+
+/* one row of the ADDRESS table, copied out by topLiveAllocations() */
+struct MallocTrancerAllocation {
+   uintptr_t address;
+   size_t size;
+   const char * position;
+   void * owner;          /* the task/thread which malloc it, see currentOwner */
+   uint32_t epoch;        /* the mark() epoch it was malloc in */
+};
+
+/* a position whose live bytes keep growing, by suspectedLeaks() */
+struct MallocTrancerLeak {
+   const char * position;
+   int liveCount;
+   size_t liveBytes;
+   long slopeBytes;        /* fitted growth per sampleTrend() period, rounded down */
+   long growthBytes;       /* fitted growth over the whole window */
+   int samples;            /* periods in the window */
+};
+
+/* per owner (task/thread) totals, copied out by getOwners() */
+struct MallocTrancerOwner {
+   void * owner;
+   int mallocCount;
+   int freeCount;
+   size_t liveBytes;
+};
+
+/* per fixed block pool counters, copied out by getPools() */
+struct MallocTrancerPool {
+   const char * name;
+   size_t blockSize;
+   int capacity;                  /* blocks */
+   int inUse;
+   int peakInUse;
+   unsigned long getCount;
+   unsigned long putCount;
+   unsigned long failCount;       /* gets which found the pool empty */
+   unsigned long getsPerSample;   /* gets between the last two samplePools() */
+};
+
+/* the high water mark of the traced live bytes, by getPeak() */
+struct MallocTrancerPeak {
+   size_t peakBytes;
+   uint32_t generation;   /* new peaks so far */
+   uint32_t time;         /* MALLOC_TRANCER_TIMESTAMP() of the last new peak */
+};
+
+/* what a position held at the high water mark */
+struct MallocTrancerPeakSite {
+   const char * position;
+   int liveCount;
+   size_t liveBytes;
+};
+
+/* a slab of a hot position, MALLOC_TRANCER_ENABLE_SLAB, copied out by getSlabs() */
+struct MallocTrancerSlab {
+   const char * position;
+   size_t blockSize;
+   int blockCount;
+   int inUse;
+   unsigned long hitCount;    /* mallocs of the position served by the slab */
+   unsigned long missCount;   /* mallocs of the position the slab could not serve, empty or other size */
+};
+
+#define MALLOC_TRANCER_PROFILE_BUCKETS 32
+
+/* latency of the tracer's own work, in MALLOC_TRANCER_CYCLES() units */
+struct MallocTrancerLatency {
+   unsigned long count;
+   uint32_t p50;          /* upper bound of the log2 bucket, not above max */
+   uint32_t p99;
+   uint32_t max;          /* exact */
+   /* histogram[i] counts [2^i, 2^(i+1)), histogram[0] also counts 0 */
+   uint32_t histogram[MALLOC_TRANCER_PROFILE_BUCKETS];
+};
+
+/* by getProfile(), MALLOC_TRANCER_ENABLE_PROFILE */
+struct MallocTrancerProfile {
+   struct MallocTrancerLatency malloc;
+   struct MallocTrancerLatency free;
+};
+
+#define MALLOC_TRANCER_GAP_HISTOGRAM_LENGTH 16
+
+/* free gaps between the live blocks inside the heap range, by getFragmentation() */
+struct MallocTrancerFragmentation {
+   uintptr_t heapStart;
+   uintptr_t heapEnd;
+   size_t usedBytes;
+   size_t freeBytes;
+   size_t largestGap;
+   int gapCount;
+   /* gapHistogram[i] counts the gaps of [2^i, 2^(i+1)) bytes, the last one counts all bigger gaps */
+   int gapHistogram[MALLOC_TRANCER_GAP_HISTOGRAM_LENGTH];
+   /* 1000 * (1 - largestGap / freeBytes), 0 means all free memory is one gap */
+   int fragmentationPermille;
+};
+
+/* the memory the tracer itself takes, by getMemoryUsage() */
+struct MallocTrancerMemory {
+   size_t siteBytes;      /* POSITION records */
+   size_t addressBytes;   /* ADDRESS entries */
+   size_t nodeBytes;      /* hash map nodes and buckets */
+   size_t keyBytes;       /* hash map key copies */
+   size_t totalBytes;
+   size_t tracedBytes;    /* live bytes of the traced blocks, to compare with */
+   size_t budget;         /* 0 means no limit */
+   unsigned long droppedAddressCount;  /* blocks not stored because of the budget */
+   unsigned long untrackedFreeCount;   /* frees of such blocks */
+   unsigned long collapsedSiteCount;   /* mallocs counted to "(other)" because of the budget */
+};
+
+/* the heap as the backend counts it next to what the tracer knows, by getHeapStats().
+ * usedBytes = tracedBytes + overheadBytes + tracerBytes + untracedBytes */
+struct MallocTrancerHeapStats {
+   size_t usedBytes;      /* by the heapUsed hook, all zero if there is none */
+   size_t tracedBytes;    /* live bytes of the traced heap blocks, the pool blocks not counted */
+   size_t overheadBytes;  /* estimated allocator headers, alignment and minimum size of them */
+   size_t tracerBytes;    /* estimated heap taken by the tracer itself, tables, snapshot buffers and slabs */
+   long untracedBytes;    /* the rest, blocks not malloc through the tracer, negative if the estimate is off */
+   /* untracedBytes over the last sampleHeap() periods */
+   int samples;
+   long untracedMin;
+   long untracedMax;
+   long untracedGrowth;   /* newest - oldest sample */
+};
+
+/* a consistent copy of the tables by takeSnapshot(), read it without the lock,
+ * the arrays stay valid until releaseSnapshot() */
+struct MallocTrancerSnapshot {
+   unsigned long generation;   /* counts the takeSnapshot() calls */
+   int siteCount;
+   struct MallocTrancerSite * sites;
+   int allocationCount;
+   struct MallocTrancerAllocation * allocations;
+   int ownerCount;
+   struct MallocTrancerOwner * owners;
+   int poolCount;
+   struct MallocTrancerPool * pools;
+   int invalidFreeCount;
+   int doubleFreeCount;
+   struct MallocTrancerMemory memory;
+   struct MallocTrancerHeapStats heap;
+   size_t peakBytes;           /* see getPeak() */
+   uint32_t peakTime;
+   int peakSiteCount;
+   struct MallocTrancerPeakSite * peakSites;   /* up to MALLOC_TRANCER_PEAK_REPORT_LENGTH, biggest first */
+   int slabCount;              /* MALLOC_TRANCER_ENABLE_SLAB */
+   struct MallocTrancerSlab * slabs;
+   struct MallocTrancerProfile profile;         /* MALLOC_TRANCER_ENABLE_PROFILE */
+   /* MALLOC_TRANCER_ENABLE_DEFERRED: getDropCount(), non zero means the tables are incomplete */
+   unsigned long droppedEventCount;
+   unsigned long unmatchedFreeCount;   /* frees of unknown blocks after a drop, not counted as bad frees */
+   unsigned long staleBlockCount;      /* blocks still traced when their address was malloc again, their free was lost */
+};
+
+/* layout of the shared memory region of MALLOC_TRANCER_ENABLE_SHM (linux),
+ * read by a external viewer, so only fixed size types here.
+ * C only, the flexible array member of MallocTrancerShm is not ISO C++ */
+#ifndef __cplusplus
+#define MALLOC_TRANCER_SHM_MAGIC 0x4D545243u   /* "MTRC" */
+#define MALLOC_TRANCER_SHM_VERSION 1
+#define MALLOC_TRANCER_SHM_POSITION_LENGTH 96
+
+struct MallocTrancerShmSite {
+   uint32_t seq;          /* odd while the tracer is writing this slot */
+   int32_t mallocCount;
+   int32_t freeCount;
+   uint32_t reserved;
+   uint64_t liveBytes;
+   uint64_t mallocBytes;
+   char position[MALLOC_TRANCER_SHM_POSITION_LENGTH];   /* written once before siteCount covers the slot */
+};
+
+struct MallocTrancerShm {
+   uint32_t magic;        /* set last, after the region is ready */
+   uint32_t version;
+   uint32_t capacity;
+   uint32_t siteCount;
+   uint32_t pid;
+   uint32_t reserved;
+   uint64_t liveBytes;
+   struct MallocTrancerShmSite sites[];
+};
+#endif  /* __cplusplus */
+
+/* compact event stream of MALLOC_TRANCER_ENABLE_STREAM, decoded by tools/MallocTracerDecode.c.
+ * every record starts with a tag byte:
+ *   bit 0-1 record type
+ *   bit 2   MALLOC/FREE: the address delta is in bytes, not in (1 << ADDRESS_SHIFT) units
+ *   bit 3-7 MALLOC: the site id if below 31, 31 means a varint site id follows
+ * then, all numbers as LEB128 varints, signed ones zigzag encoded:
+ *   MALLOC: time delta, [site id], size, signed address delta
+ *   FREE:   time delta, signed address delta
+ *   SITE:   site id, position length, position bytes (sent before the first MALLOC of the site)
+ *   SYNC:   version, events dropped so far (first record, and after a drop; resets time and address to 0) */
+#define MALLOC_TRANCER_STREAM_MALLOC 0
+#define MALLOC_TRANCER_STREAM_FREE   1
+#define MALLOC_TRANCER_STREAM_SITE   2
+#define MALLOC_TRANCER_STREAM_SYNC   3
+#define MALLOC_TRANCER_STREAM_RAW_ADDRESS 0x04
+#define MALLOC_TRANCER_STREAM_SITE_INLINE_MAX 31
+#define MALLOC_TRANCER_STREAM_ADDRESS_SHIFT 3
+#define MALLOC_TRANCER_STREAM_VERSION 1
+
+/* which rows getFilteredInfo()/takeFilteredSnapshot() keep, zero/NULL fields match everything.
+ * the site fields select the positions, the blocks of the ADDRESS table must
+ * also be of a selected position */
+struct MallocTrancerFilter {
+   const char * filePrefix;   /* the position starts with it, e.g. "net/" */
+   const char * func;         /* the function of the position, exact */
+   int minLiveCount;          /* malloc - free of the position */
+   size_t minLiveBytes;
+   uint32_t minAge;           /* MALLOC_TRANCER_ENABLE_LIFETIME: the block is at least this old, in LIFETIME_CLOCK ticks */
+   void * owner;              /* the block was malloc by this task/thread, see currentOwner */
+};
+
+/* one more traced heap, e.g. a external SRAM or a DMA region with its own allocator */
+struct MallocTrancerHeapConfig {
+   const char * name;                 /* for the combined report */
+   void * (*malloc)(size_t size);     /* the backend, NULL for malloc/free */
+   void (*free)(void * ptr);
+   size_t capacity;                   /* bytes of the heap for the report, 0 if unknown */
+   size_t memoryBudget;               /* max bytes for the tables of this heap, 0 means no limit */
+};
 
 struct MallocTrancer {
-   char * (*getMallocInfo)(void);
+   char * (*getMallocInfo)(struct MallocTrancer * tracer);
+   int (*topSites)(struct MallocTrancer * tracer, enum MallocTrancerMetric metric, int n, struct MallocTrancerSite * out);
+   int (*topLiveAllocations)(struct MallocTrancer * tracer, int n, struct MallocTrancerAllocation * out);
+   /* verify the redzone of every live block, return the corrupted count */
+   int (*checkAll)(struct MallocTrancer * tracer);
+   /* the heap range getFragmentation() measures, 0/0 to use the first/last live block */
+   void (*setHeapRange)(struct MallocTrancer * tracer, uintptr_t start, uintptr_t end);
+   bool (*getFragmentation)(struct MallocTrancer * tracer, struct MallocTrancerFragmentation * out);
+   /* which live block contains this address, false if none */
+   bool (*findOwner)(struct MallocTrancer * tracer, uintptr_t address, struct MallocTrancerAllocation * out);
+   int (*getOwners)(struct MallocTrancer * tracer, int n, struct MallocTrancerOwner * out);
+   /* start a new epoch, the blocks malloc from now on carry it */
+   uint32_t (*mark)(struct MallocTrancer * tracer);
+   /* count the live blocks malloc in this epoch or later, the first n are copied to out (may be NULL) */
+   int (*liveSince)(struct MallocTrancer * tracer, uint32_t epoch, int n, struct MallocTrancerAllocation * out);
+   /* MALLOC_TRANCER_ENABLE_DEFERRED: apply the pending events, call it from a low priority task */
+   int (*drain)(struct MallocTrancer * tracer);
+   /* events lost because a ring was full */
+   unsigned long (*getDropCount)(struct MallocTrancer * tracer);
+   /* linux only: drain from a pthread every periodMs */
+   bool (*startAggregator)(struct MallocTrancer * tracer, unsigned int periodMs);
+   void (*getMemoryUsage)(struct MallocTrancer * tracer, struct MallocTrancerMemory * out);
+   /* max bytes for the tracer tables, 0 means no limit, see MALLOC_TRANCER_MEMORY_BUDGET */
+   void (*setMemoryBudget)(struct MallocTrancer * tracer, size_t bytes);
+   /* linux, MALLOC_TRANCER_ENABLE_SHM: publish the POSITION counters for tools/MallocTracerView, NULL for the default name */
+   bool (*openShm)(struct MallocTrancer * tracer, const char * name);
+   /* copy the tables under the lock, NULL if both snapshot buffers are held or out of memory */
+   struct MallocTrancerSnapshot * (*takeSnapshot)(struct MallocTrancer * tracer);
+   void (*releaseSnapshot)(struct MallocTrancer * tracer, struct MallocTrancerSnapshot * snapshot);
+   /* the same, only the rows matching filter are copied/formatted/sent, filter may be NULL */
+   struct MallocTrancerSnapshot * (*takeFilteredSnapshot)(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter);
+   char * (*getFilteredInfo)(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter);
+   bool (*sendFilteredReport)(struct MallocTrancer * tracer, const struct MallocTrancerFilter * filter);
+   /* MALLOC_TRANCER_ENABLE_TREND: record one period of the live bytes of each active position, call it periodically */
+   void (*sampleTrend)(struct MallocTrancer * tracer);
+   /* the positions with sustained growth over the window, biggest slope first */
+   int (*suspectedLeaks)(struct MallocTrancer * tracer, int n, struct MallocTrancerLeak * out);
+   /* MALLOC_TRANCER_ENABLE_STREAM: send every malloc/free to sink as a compact record, NULL to stop */
+   void (*setEventStream)(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context);
+   /* records the sink refused */
+   unsigned long (*getStreamDropCount)(struct MallocTrancer * tracer);
+   /* MALLOC_TRANCER_ENABLE_TRANSPORT: send through this link, NULL to detach. the struct must stay alive */
+   void (*setTransport)(struct MallocTrancer * tracer, struct MallocTrancerTransport * transport);
+   /* a sink for setEventStream()/writePprof() which stages the data for the transport */
+   MallocTrancerSink transportSink;
+   /* push the staged bytes, call it from a idle/low priority task, return the bytes still staged */
+   size_t (*flushTransport)(struct MallocTrancer * tracer);
+   /* send getMallocInfo() through the transport, waits for the link whatever the policy */
+   bool (*sendReport)(struct MallocTrancer * tracer);
+   /* linux: a transport to a file or a named pipe, non-blocking */
+   bool (*openFileTransport)(struct MallocTrancer * tracer, const char * path, enum MallocTrancerPolicy policy);
+   /* stream a pprof profile.proto heap profile (uncompressed) to sink, one location per position */
+   bool (*writePprof)(struct MallocTrancer * tracer, MallocTrancerSink sink, void * context);
+   /* stream the tables to sink as JSON lines or CSV, one record per row, filter may be NULL */
+   bool (*writeReport)(struct MallocTrancer * tracer, enum MallocTrancerFormat format,
+           const struct MallocTrancerFilter * filter, MallocTrancerSink sink, void * context);
+   /* register a fixed block pool for trace_pool_get/trace_pool_put, return its id, -1 if full */
+   int (*addPool)(struct MallocTrancer * tracer, const char * name, size_t blockSize, int capacity);
+   int (*getPools)(struct MallocTrancer * tracer, int n, struct MallocTrancerPool * out);
+   /* close one rate period of the pools, call it periodically */
+   void (*samplePools)(struct MallocTrancer * tracer);
+   /* MALLOC_TRANCER_ENABLE_PROFILE: latency of trace_malloc/trace_free without the backend, all zero if disabled */
+   void (*getProfile)(struct MallocTrancer * tracer, struct MallocTrancerProfile * out);
+   /* MALLOC_TRANCER_ENABLE_SLAB: the slabs made for the hot positions so far */
+   int (*getSlabs)(struct MallocTrancer * tracer, int n, struct MallocTrancerSlab * out);
+   /* record one period of the untraced bytes, call it periodically (after drain() in deferred mode) */
+   void (*sampleHeap)(struct MallocTrancer * tracer);
+   /* reconcile the traced bytes with heapUsed, false if there is no heapUsed hook */
+   bool (*getHeapStats)(struct MallocTrancer * tracer, struct MallocTrancerHeapStats * out);
+   /* the high water mark and the n positions which held the most at it, biggest first, return how many */
+   int (*getPeak)(struct MallocTrancer * tracer, struct MallocTrancerPeak * peak, int n, struct MallocTrancerPeakSite * out);
+   /* make the live bytes of now the peak, e.g. after the start up */
+   void (*resetPeak)(struct MallocTrancer * tracer);
+
+   /* hooks set by the user, NULL by default */
+   /* return the current task/thread handle, e.g. xTaskGetCurrentTaskHandle */
+   void * (*currentOwner)(void);
+   /* return a printable name of a owner for the report, e.g. pcTaskGetName */
+   const char * (*ownerName)(void * owner);
+   /* return the bytes in use of the heap as the backend counts them, e.g. from mallinfo2,
+    * set by MALLOC_TRANCER_HEAP_STATS for the default heap */
+   size_t (*heapUsed)(void);
 };
 
 struct MallocTrancer * New_MallocTrancer(void);
+struct MallocTrancer * New_MallocTrancerHeap(const struct MallocTrancerHeapConfig * config);
+/* getMallocInfo() of every heap, one after another, free() it after use */
+char * MallocTrancer_getAllInfo(void);
 void * _trace_malloc(size_t size, const char *file, const char *func,const long line);
 void _trace_free(void * ptr, const char *file, const char *func,const long line);
+void * _trace_heap_malloc(struct MallocTrancer * tracer, size_t size, const char *file, const char *func,const long line);
+void _trace_heap_free(struct MallocTrancer * tracer, void * ptr, const char *file, const char *func,const long line);
+void * _trace_pool_get(struct MallocTrancer * tracer, int id, void * ptr, const char *file, const char *func,const long line);
+void _trace_pool_put(struct MallocTrancer * tracer, int id, void * ptr, const char *file, const char *func,const long line);
+/* the position record of "file-line-func" on the default heap, look it up once and keep it,
+ * _trace_malloc_site/_trace_free_site do no string formatting for the position */
+struct MallocTrancerInfo;
+struct MallocTrancerInfo * _trace_site(const char *file, const char *func,const long line);
+void * _trace_malloc_site(size_t size, struct MallocTrancerInfo * site);
+void _trace_free_site(void * ptr, struct MallocTrancerInfo * site);
+
+#ifdef __cplusplus
+}
+#endif
 
-#endif  /* __MALLOC_TRANCER__ */
\ No newline at end of file
+#endif  /* __MALLOC_TRANCER__ */
@@ -0,0 +1,320 @@
+#ifndef __MALLOC_TRANCER_HPP__
+#define __MALLOC_TRANCER_HPP__
+
+/**
+ * description: C++ side of MallocTracer, header only, C++17.
+ *   - TracingAllocator<T, Tag> for the STL containers
+ *   - trace_new<T>()/trace_delete() for single objects
+ *   - per Tag and per type counters, the names are compile time constants
+ *   - LeakScope, no block malloc inside a scope may be live at its end
+ *   - #define MALLOC_TRANCER_REPLACE_NEW before including it in ONE .cpp
+ *     to route the global operator new/delete into the tracer too
+ * the blocks show up in the POSITION table as "<Tag>-0-<T>".
+ */
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <string_view>
+#include <utility>
+#include "MallocTracer.h"
+
+namespace MallocTracer {
+
+namespace detail {
+
+template<class T>
+constexpr std::string_view rawTypeName() {
+#if defined(__clang__)
+    std::string_view name = __PRETTY_FUNCTION__;   /* "... rawTypeName() [T = int]" */
+    std::string_view prefix = "T = ";
+    std::size_t begin = name.find(prefix) + prefix.size();
+    return name.substr(begin, name.rfind(']') - begin);
+#elif defined(__GNUC__)
+    std::string_view name = __PRETTY_FUNCTION__;   /* "... rawTypeName() [with T = int; std::string_view = ...]" */
+    std::string_view prefix = "T = ";
+    std::size_t begin = name.find(prefix) + prefix.size();
+    std::size_t end = name.find(';', begin);
+    return name.substr(begin, (end == std::string_view::npos ? name.rfind(']') : end) - begin);
+#elif defined(_MSC_VER)
+    std::string_view name = __FUNCSIG__;           /* "... rawTypeName<int>(void)" */
+    std::string_view prefix = "rawTypeName<";
+    std::size_t begin = name.find(prefix) + prefix.size();
+    return name.substr(begin, name.rfind(">(void)") - begin);
+#else
+    return "?";
+#endif
+}
+
+}  // namespace detail
+
+/* the name of T as a NUL terminated compile time constant */
+template<class T>
+struct TypeName {
+    static constexpr std::string_view view = detail::rawTypeName<T>();
+
+    static constexpr std::array<char, view.size() + 1> make() {
+        std::array<char, view.size() + 1> out{};
+        for(std::size_t i = 0; i < view.size(); i++) out[i] = view[i];
+        return out;
+    }
+
+    static constexpr std::array<char, view.size() + 1> value = make();
+
+    static constexpr const char * c_str() { return value.data(); }
+};
+
+/* counters of one Tag or one type, linked in a list on first use */
+struct Stats {
+    const char * name;
+    std::atomic<unsigned long> mallocCount{0};
+    std::atomic<unsigned long> freeCount{0};
+    std::atomic<std::size_t> mallocBytes{0};
+    std::atomic<std::size_t> liveBytes{0};
+    Stats * next;
+
+    Stats(const char * statsName, std::atomic<Stats *> & list) : name(statsName), next(list.load()) {
+        while(!list.compare_exchange_weak(next, this)) {
+        }
+    }
+};
+
+namespace detail {
+
+inline std::atomic<Stats *> & tagList() {
+    static std::atomic<Stats *> head{nullptr};
+    return head;
+}
+
+inline std::atomic<Stats *> & typeList() {
+    static std::atomic<Stats *> head{nullptr};
+    return head;
+}
+
+template<class Tag>
+Stats & tagStats() {
+    static Stats stats(TypeName<Tag>::c_str(), tagList());
+    return stats;
+}
+
+template<class T>
+Stats & typeStats() {
+    static Stats stats(TypeName<T>::c_str(), typeList());
+    return stats;
+}
+
+/* the tables must exist before the first block, even one from a static constructor */
+inline void init() {
+    static struct MallocTrancer * tracer = New_MallocTrancer();
+    (void)tracer;
+}
+
+inline void countMalloc(Stats & stats, std::size_t bytes) {
+    stats.mallocCount.fetch_add(1, std::memory_order_relaxed);
+    stats.mallocBytes.fetch_add(bytes, std::memory_order_relaxed);
+    stats.liveBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+inline void countFree(Stats & stats, std::size_t bytes) {
+    stats.freeCount.fetch_add(1, std::memory_order_relaxed);
+    stats.liveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+/* the position record of "<Tag>-0-<T>", formatted once per pair */
+template<class Tag, class T>
+struct MallocTrancerInfo * site() {
+    static struct MallocTrancerInfo * info = _trace_site(TypeName<Tag>::c_str(), TypeName<T>::c_str(), 0);
+    return info;
+}
+
+template<class Tag, class T>
+void * traceMalloc(std::size_t bytes) {
+    init();
+    void * p = _trace_malloc_site(bytes, site<Tag, T>());
+    if(!p) throw std::bad_alloc();
+    countMalloc(tagStats<Tag>(), bytes);
+    countMalloc(typeStats<T>(), bytes);
+    return p;
+}
+
+template<class Tag, class T>
+void traceFree(void * p, std::size_t bytes) noexcept {
+    countFree(tagStats<Tag>(), bytes);
+    countFree(typeStats<T>(), bytes);
+    _trace_free_site(p, site<Tag, T>());
+}
+
+}  // namespace detail
+
+/* the Tag of the blocks from trace_new() */
+struct NewTag {};
+/* the Tag of a TracingAllocator without one */
+struct DefaultTag {};
+
+/* list of the per Tag / per type counters, follow ->next */
+inline const Stats * tags() { return detail::tagList().load(); }
+inline const Stats * types() { return detail::typeList().load(); }
+
+/* a std allocator which traces, e.g. std::vector<int, TracingAllocator<int, struct RxQueue>> */
+template<class T, class Tag = DefaultTag>
+struct TracingAllocator {
+    using value_type = T;
+
+    template<class U>
+    struct rebind {
+        using other = TracingAllocator<U, Tag>;
+    };
+
+    TracingAllocator() noexcept = default;
+
+    template<class U>
+    TracingAllocator(const TracingAllocator<U, Tag> &) noexcept {}
+
+    T * allocate(std::size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over aligned types are not supported");
+        return static_cast<T *>(detail::traceMalloc<Tag, T>(n * sizeof(T)));
+    }
+
+    void deallocate(T * p, std::size_t n) noexcept {
+        detail::traceFree<Tag, T>(p, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(const TracingAllocator<U, Tag> &) const noexcept { return true; }
+
+    template<class U>
+    bool operator!=(const TracingAllocator<U, Tag> &) const noexcept { return false; }
+};
+
+/* new a T, counted to NewTag and to T */
+template<class T, class... Args>
+T * trace_new(Args &&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over aligned types are not supported");
+    void * p = detail::traceMalloc<NewTag, T>(sizeof(T));
+    try {
+        return new(p) T(std::forward<Args>(args)...);
+    }
+    catch(...) {
+        detail::traceFree<NewTag, T>(p, sizeof(T));
+        throw;
+    }
+}
+
+template<class T>
+void trace_delete(T * p) noexcept {
+    if(!p) return;
+    p->~T();
+    detail::traceFree<NewTag, T>(p, sizeof(T));
+}
+
+/**
+ * a mark() at construction, the blocks malloc since then and still live
+ * at destruction are leaks, e.g. around "process one request" in a soak test.
+ * with no onLeak it asserts, else onLeak gets the count and up to
+ * LEAK_SCOPE_REPORT_LENGTH of the blocks.
+ */
+class LeakScope {
+public:
+    static constexpr int LEAK_SCOPE_REPORT_LENGTH = 8;
+    using OnLeak = void (*)(int count, const struct MallocTrancerAllocation * blocks, int n);
+
+    explicit LeakScope(OnLeak onLeak = nullptr) : tracer(New_MallocTrancer()), onLeak(onLeak) {
+        tracer->drain(tracer);
+        epoch = tracer->mark(tracer);
+    }
+
+    LeakScope(const LeakScope &) = delete;
+    LeakScope & operator=(const LeakScope &) = delete;
+
+    /* the blocks malloc in this scope and still live */
+    int live() const {
+        tracer->drain(tracer);
+        return tracer->liveSince(tracer, epoch, 0, nullptr);
+    }
+
+    ~LeakScope() {
+        struct MallocTrancerAllocation blocks[LEAK_SCOPE_REPORT_LENGTH];
+        tracer->drain(tracer);
+        int count = tracer->liveSince(tracer, epoch, LEAK_SCOPE_REPORT_LENGTH, blocks);
+        if(!count) return;
+        if(onLeak) onLeak(count, blocks, count < LEAK_SCOPE_REPORT_LENGTH ? count : LEAK_SCOPE_REPORT_LENGTH);
+        else assert(!"blocks malloc in a LeakScope are still live");
+    }
+
+private:
+    struct MallocTrancer * tracer;
+    OnLeak onLeak;
+    uint32_t epoch = 0;
+};
+
+}  // namespace MallocTracer
+
+#ifdef MALLOC_TRANCER_REPLACE_NEW
+
+/* the global operator new/delete, counted to the position "operator-0-new" */
+
+namespace MallocTracer {
+namespace detail {
+
+inline struct MallocTrancerInfo * newSite() {
+    static struct MallocTrancerInfo * info = _trace_site("operator", "new", 0);
+    return info;
+}
+
+inline struct MallocTrancerInfo * deleteSite() {
+    static struct MallocTrancerInfo * info = _trace_site("operator", "delete", 0);
+    return info;
+}
+
+}  // namespace detail
+}  // namespace MallocTracer
+
+void * operator new(std::size_t size) {
+    MallocTracer::detail::init();
+    void * p = _trace_malloc_site(size ? size : 1, MallocTracer::detail::newSite());
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void * operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    MallocTracer::detail::init();
+    return _trace_malloc_site(size ? size : 1, MallocTracer::detail::newSite());
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t & tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void * p) noexcept {
+    _trace_free_site(p, MallocTracer::detail::deleteSite());
+}
+
+void operator delete[](void * p) noexcept {
+    _trace_free_site(p, MallocTracer::detail::deleteSite());
+}
+
+void operator delete(void * p, std::size_t) noexcept {
+    _trace_free_site(p, MallocTracer::detail::deleteSite());
+}
+
+void operator delete[](void * p, std::size_t) noexcept {
+    _trace_free_site(p, MallocTracer::detail::deleteSite());
+}
+
+void operator delete(void * p, const std::nothrow_t &) noexcept {
+    _trace_free_site(p, MallocTracer::detail::deleteSite());
+}
+
+void operator delete[](void * p, const std::nothrow_t &) noexcept {
+    _trace_free_site(p, MallocTracer::detail::deleteSite());
+}
+
+#endif  /* MALLOC_TRANCER_REPLACE_NEW */
+
+#endif  /* __MALLOC_TRANCER_HPP__ */
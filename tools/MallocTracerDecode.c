@@ -0,0 +1,184 @@
+/**
+ * description: host decoder of the event stream of MALLOC_TRANCER_ENABLE_STREAM,
+ *              rebuilds the POSITION and ADDRESS tables from the MALLOC/FREE records.
+ * build: gcc -I../src MallocTracerDecode.c -o MallocTracerDecode
+ * usage: MallocTracerDecode [stream file, default stdin]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MallocTracer.h"
+
+struct Site {
+    char * position;
+    int mallocCount;
+    int freeCount;
+    uint64_t mallocBytes;
+    uint64_t freeBytes;
+    uint64_t lastAddress;
+};
+
+/* live block, chained in a bucket of the address hash */
+struct Block {
+    uint64_t address;
+    uint64_t size;
+    uint32_t site;
+    struct Block * next;
+};
+
+#define BUCKET_COUNT 4096
+
+static struct Site * sites = NULL;
+static uint32_t siteCapacity = 0;
+static struct Block * buckets[BUCKET_COUNT];
+static FILE * in;
+static unsigned long recordCount = 0, eventCount = 0, unknownFreeCount = 0, dropCount = 0;
+static unsigned long byteCount = 0, eventByteCount = 0;
+static uint64_t lastTime = 0;   /* of the last record, in the device's MALLOC_TRANCER_TIMESTAMP unit */
+
+static bool read_byte(uint8_t * out) {
+    int c = fgetc(in);
+    if(c == EOF) return false;
+    byteCount++;
+    *out = (uint8_t)c;
+    return true;
+}
+
+static bool read_varint(uint64_t * out) {
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+        if(!read_byte(&byte)) return false;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) {
+            *out = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static struct Site * get_site(uint32_t id) {
+    if(id >= siteCapacity) {
+        uint32_t capacity = siteCapacity ? siteCapacity : 64;
+        while(capacity <= id) capacity *= 2;
+        sites = realloc(sites, capacity * sizeof(struct Site));
+        memset(sites + siteCapacity, 0, (capacity - siteCapacity) * sizeof(struct Site));
+        siteCapacity = capacity;
+    }
+    return &sites[id];
+}
+
+static struct Block ** find_block(uint64_t address) {
+    struct Block ** link = &buckets[(address >> MALLOC_TRANCER_STREAM_ADDRESS_SHIFT) % BUCKET_COUNT];
+    while(*link && (*link)->address != address) link = &(*link)->next;
+    return link;
+}
+
+static void print_tables(void) {
+    printf("\r\n %-64s | %-18s | %8s | %8s | %12s", "POSITION", "ADDRESS", "MALLOC", "FREE", "LIVE BYTES");
+    for(uint32_t i = 0; i < siteCapacity; i++) {
+        struct Site * site = &sites[i];
+        if(!site->position) continue;
+        printf("\r\n %-64s | %#-18llx | %8d | %8d | %12llu", site->position, (unsigned long long)site->lastAddress,
+                site->mallocCount, site->freeCount, (unsigned long long)(site->mallocBytes - site->freeBytes));
+    }
+    printf("\r\n\r\n %-18s | %-10s | %s", "ADDRESS", "SIZE", "POSITION");
+    for(int i = 0; i < BUCKET_COUNT; i++) {
+        for(struct Block * block = buckets[i]; block; block = block->next) {
+            const char * position = block->site < siteCapacity && sites[block->site].position ? sites[block->site].position : "?";
+            printf("\r\n %#-18llx | %10llu | %s", (unsigned long long)block->address, (unsigned long long)block->size, position);
+        }
+    }
+    printf("\r\n\r\n %lu records, %lu malloc/free, %.2f bytes per malloc/free, %lu unknown frees, %lu dropped by the device, last time %llu\r\n",
+            recordCount, eventCount, eventCount ? (double)eventByteCount / eventCount : 0.0, unknownFreeCount, dropCount, (unsigned long long)lastTime);
+}
+
+int main(int argc, char ** argv) {
+    in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if(!in) {
+        perror("fopen");
+        return 1;
+    }
+
+    uint64_t address = 0;
+    uint8_t tag;
+    while(read_byte(&tag)) {
+        unsigned long recordStart = byteCount - 1;
+        uint8_t type = tag & 0x03;
+        uint64_t value, id = 0, size = 0;
+        recordCount++;
+
+        if(type == MALLOC_TRANCER_STREAM_SYNC) {
+            if(!read_varint(&value)) break;
+            if(value != MALLOC_TRANCER_STREAM_VERSION) {
+                fprintf(stderr, "version %llu not supported\n", (unsigned long long)value);
+                return 1;
+            }
+            if(!read_varint(&value)) break;
+            dropCount = value;
+            lastTime = 0;
+            address = 0;
+            continue;
+        }
+        if(type == MALLOC_TRANCER_STREAM_SITE) {
+            uint64_t length;
+            if(!read_varint(&id) || !read_varint(&length)) break;
+            struct Site * site = get_site((uint32_t)id);
+            free(site->position);
+            site->position = malloc(length + 1);
+            if(fread(site->position, 1, length, in) != length) break;
+            byteCount += length;
+            site->position[length] = '\0';
+            continue;
+        }
+
+        if(!read_varint(&value)) break;
+        lastTime += value;
+        if(type == MALLOC_TRANCER_STREAM_MALLOC) {
+            id = tag >> 3;
+            if(id == MALLOC_TRANCER_STREAM_SITE_INLINE_MAX && !read_varint(&id)) break;
+            if(!read_varint(&size)) break;
+        }
+        if(!read_varint(&value)) break;
+        int64_t delta = unzigzag(value);
+        address += (tag & MALLOC_TRANCER_STREAM_RAW_ADDRESS) ? (uint64_t)delta : (uint64_t)delta << MALLOC_TRANCER_STREAM_ADDRESS_SHIFT;
+        eventCount++;
+        eventByteCount += byteCount - recordStart;
+
+        struct Block ** link = find_block(address);
+        if(type == MALLOC_TRANCER_STREAM_MALLOC) {
+            struct Site * site = get_site((uint32_t)id);
+            site->mallocCount++;
+            site->mallocBytes += size;
+            site->lastAddress = address;
+            if(!*link) {
+                *link = calloc(1, sizeof(struct Block));
+                (*link)->address = address;
+            }
+            (*link)->size = size;
+            (*link)->site = (uint32_t)id;
+        }
+        else if(*link) {
+            struct Block * block = *link;
+            struct Site * site = get_site(block->site);
+            site->freeCount++;
+            site->freeBytes += block->size;
+            *link = block->next;
+            free(block);
+        }
+        else {
+            unknownFreeCount++;
+        }
+    }
+
+    print_tables();
+    return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * description: live viewer of the POSITION counters a traced process publishes
+ *              with MALLOC_TRANCER_ENABLE_SHM, the traced process is never paused.
+ * build: gcc -I../src MallocTracerView.c -o MallocTracerView (-lrt on old glibc)
+ * usage: MallocTracerView [shm name, default /MallocTracer] [top N, default 20] [period ms, default 1000]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "MallocTracer.h"
+
+/**
+ * @brief copy a slot consistently, retry while the tracer is writing it
+ */
+static void read_site(const struct MallocTrancerShmSite * site, struct MallocTrancerShmSite * out) {
+    for(;;) {
+        uint32_t seq = __atomic_load_n(&site->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+        memcpy(out, site, sizeof(struct MallocTrancerShmSite));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&site->seq, __ATOMIC_RELAXED) == seq) return;
+    }
+}
+
+static int compare_live_bytes(const void * a, const void * b) {
+    const struct MallocTrancerShmSite * x = a, * y = b;
+    return x->liveBytes < y->liveBytes ? 1 : (x->liveBytes > y->liveBytes ? -1 : 0);
+}
+
+int main(int argc, char ** argv) {
+    const char * name = argc > 1 ? argv[1] : "/MallocTracer";
+    int top = argc > 2 ? atoi(argv[2]) : 20;
+    int periodMs = argc > 3 ? atoi(argv[3]) : 1000;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) {
+        perror("shm_open");
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct MallocTrancerShm)) {
+        fprintf(stderr, "bad region %s\n", name);
+        return 1;
+    }
+    const struct MallocTrancerShm * region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(region == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    while(__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != MALLOC_TRANCER_SHM_MAGIC) {
+        usleep(10000);
+    }
+    if(region->version != MALLOC_TRANCER_SHM_VERSION) {
+        fprintf(stderr, "version %u not supported\n", region->version);
+        return 1;
+    }
+
+    /* a short or foreign region must not make read_site() run past the mapping */
+    uint32_t capacity = region->capacity;
+    if(capacity > ((size_t)st.st_size - sizeof(struct MallocTrancerShm)) / sizeof(struct MallocTrancerShmSite)) {
+        fprintf(stderr, "bad region %s, capacity %u does not fit %lld bytes\n", name, capacity, (long long)st.st_size);
+        return 1;
+    }
+    struct MallocTrancerShmSite * sites = malloc((capacity ? capacity : 1) * sizeof(struct MallocTrancerShmSite));
+    if(!sites) {
+        perror("malloc");
+        return 1;
+    }
+    for(;;) {
+        uint32_t count = __atomic_load_n(&region->siteCount, __ATOMIC_ACQUIRE);
+        if(count > capacity) count = capacity;
+        for(uint32_t i = 0; i < count; i++) {
+            read_site(&region->sites[i], &sites[i]);
+        }
+        qsort(sites, count, sizeof(struct MallocTrancerShmSite), compare_live_bytes);
+
+        printf("\033[2J\033[H pid %u, live %llu bytes, %u positions\r\n",
+                region->pid, (unsigned long long)__atomic_load_n(&region->liveBytes, __ATOMIC_RELAXED), count);
+        printf(" %-64s | %12s | %10s | %10s\r\n", "POSITION", "LIVE BYTES", "MALLOC", "FREE");
+        for(uint32_t i = 0; i < count && (int)i < top; i++) {
+            printf(" %-64.64s | %12llu | %10d | %10d\r\n", sites[i].position,
+                    (unsigned long long)sites[i].liveBytes, sites[i].mallocCount, sites[i].freeCount);
+        }
+        fflush(stdout);
+        usleep(periodMs * 1000);
+    }
+    return 0;
+}